@@ -0,0 +1,154 @@
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <vector>
+
+#include "BudgetedRender.h"
+#include "RayTracer.h"
+#include "scene/raystats.h"
+
+static const char* outcomeNames[BudgetedRender::NUM_OUTCOMES] = {
+	"finished", "out of time", "out of rays", "stopped"
+};
+
+const char* BudgetedRender::outcomeName(Outcome outcome) {
+	return outcome >= 0 && outcome < NUM_OUTCOMES ? outcomeNames[outcome] : "?";
+}
+
+BudgetedRender::BudgetedRender(WorkerPool& p, RenderJob& j)
+	: pool(p), job(j), cancelled(false), outcome(FINISHED), width(0), height(0), numRounds(0),
+	  wholeFrame(false), startTime(clock::now()), endTime(startTime), running(false),
+	  raysAtStart(0), raysAtEnd(0), meanSamples(0), fewestSamples(0), mostSamples(0), maxError(0)
+{
+}
+
+double BudgetedRender::elapsed() const {
+	clock::time_point end = running ? clock::now() : endTime;
+	return std::chrono::duration<double>(end - startTime).count();
+}
+
+unsigned long long BudgetedRender::raysTraced() const {
+	return (running ? RayStats::total().total() : raysAtEnd) - raysAtStart;
+}
+
+BudgetedRender::Outcome BudgetedRender::render(RayTracer* tracer, int w, int h,
+	const RenderSettings& settings, const Budget& budget, pollFunc poll, void* arg)
+{
+	width = w;
+	height = h;
+	numRounds = 0;
+	wholeFrame = false;
+	outcome = FINISHED;
+	cancelled.store(false);
+	startTime = clock::now();
+	raysAtStart = RayStats::total().total();
+	running = true;
+
+	RenderSettings s = settings;
+	s.antialias = false;
+	tracer->traceSetup(width, height, s);
+
+	// The job itself stops where the ray budget runs out; waiting on it
+	// alone would overrun it by whatever gets traced between two looks
+	unsigned long long rayLimit = job.getRayLimit();
+	job.setRayLimit(budget.rays);
+
+	// One sample each, coarse to fine
+	bool progressive = job.getProgressive();
+	job.setProgressive(true);
+	job.start(tracer, pool, width, height);
+	bool going = waitForJob(budget, poll, arg);
+	wholeFrame = job.passesDone() == job.passes();
+	job.setProgressive(progressive);
+
+	// Then enough for every pixel to tell how noisy it is, then more where
+	// it is noisiest
+	RenderJob::Refinement r;
+	r.minError = -1.0;
+	r.samples = FIRST_SAMPLES - 1;
+	r.maxSamples = budget.maxSamples;
+	while (going) {
+		if (budget.rays > 0) {
+			unsigned long long traced = raysTraced();
+			if (traced >= budget.rays) {
+				outcome = OUT_OF_RAYS;
+				break;
+			}
+			job.setRayLimit(budget.rays - traced);
+		}
+		numRounds++;
+		job.startRefinement(tracer, pool, 0, 0, width, height, r);
+		going = waitForJob(budget, poll, arg) && nextRound(tracer, budget, r);
+	}
+	job.setRayLimit(rayLimit);
+
+	running = false;
+	endTime = clock::now();
+	raysAtEnd = RayStats::total().total();
+	measure(tracer);
+	return outcome;
+}
+
+bool BudgetedRender::waitForJob(const Budget& budget, pollFunc poll, void* arg) {
+	for (;;) {
+		bool done = job.wait(10);
+		if (cancelled.load())
+			outcome = STOPPED;
+		else if (budget.seconds > 0 && elapsed() >= budget.seconds)
+			outcome = OUT_OF_TIME;
+		else if (budget.rays > 0 && raysTraced() >= budget.rays)
+			outcome = OUT_OF_RAYS;
+		else if (!done && poll && !poll(this, arg))
+			outcome = STOPPED;
+		else if (done)
+			return true;
+		else
+			continue;
+
+		job.cancel();
+		job.wait(WorkerPool::NO_TIMEOUT);
+		return false;
+	}
+}
+
+bool BudgetedRender::nextRound(RayTracer* tracer, const Budget& budget, RenderJob::Refinement& r) {
+	// The pixels that could still do with more samples
+	std::vector<double> errors;
+	for (int j = 0; j < height; j++) {
+		for (int i = 0; i < width; i++) {
+			double e = tracer->pixelError(i, j);
+			if (tracer->pixelSamples(i, j) < budget.maxSamples && e > budget.targetError)
+				errors.push_back(e);
+		}
+	}
+	if (errors.empty())
+		return false;
+
+	// The worst quarter of the frame's pixels, or all of those if fewer;
+	// ties with the last one picked go in too
+	size_t quarter = std::max((size_t)1, (size_t)width * height / 4);
+	size_t k = errors.size() > quarter ? errors.size() - quarter : 0;
+	std::nth_element(errors.begin(), errors.begin() + k, errors.end());
+	r.minError = std::nextafter(errors[k], -HUGE_VAL);
+	r.samples = ROUND_SAMPLES;
+	return true;
+}
+
+void BudgetedRender::measure(RayTracer* tracer) {
+	double total = 0;
+	fewestSamples = width * height > 0 ? INT_MAX : 0;
+	mostSamples = 0;
+	maxError = 0;
+	for (int j = 0; j < height; j++) {
+		for (int i = 0; i < width; i++) {
+			int n = tracer->pixelSamples(i, j);
+			total += n;
+			fewestSamples = std::min(fewestSamples, n);
+			mostSamples = std::max(mostSamples, n);
+			double e = tracer->pixelError(i, j);
+			if (n > 1 && e > maxError)
+				maxError = e;
+		}
+	}
+	meanSamples = width * height > 0 ? total / ((double)width * height) : 0;
+}
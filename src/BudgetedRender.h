@@ -0,0 +1,120 @@
+// BudgetedRender.h
+// Renders a frame to a budget instead of to a fixed quality: by a wall
+// clock deadline, within a number of rays, or both.  The frame is first
+// traced at one sample per pixel, progressively (see
+// RenderJob::setProgressive()), so that it is whole early on.  Then every
+// pixel gets a few samples more, enough to tell how noisy it is, and from
+// then on, round after round, the noisiest quarter of the pixels get more
+// samples still (see RayTracer::samplePixel()).  It stops when the budget
+// runs out, or once every pixel is under the target error or has as many
+// samples as it may have.  Whatever is in the buffer when it stops is the
+// frame.
+//
+// The rounds run as RenderJobs on a WorkerPool, and the deadline is
+// checked every few milliseconds while they do, so it is overrun by little
+// more than a band of rows' worth of work.  The ray budget is kept by the
+// job itself (see RenderJob::setRayLimit()), to within about a pixel's
+// rays per thread.
+
+#ifndef BUDGETED_RENDER_H
+#define BUDGETED_RENDER_H
+
+#include <atomic>
+#include <chrono>
+
+#include "RenderJob.h"
+#include "RenderSettings.h"
+
+class RayTracer;
+
+class BudgetedRender
+{
+public:
+	struct Budget
+	{
+		Budget()
+			: seconds( 0 ), rays( 0 ), targetError( 0 ), maxSamples( 64 )
+		{ }
+
+		double seconds;				// wall clock, or 0 for no deadline
+		unsigned long long rays;	// or 0 for no limit
+		double targetError;			// pixels whose RayTracer::pixelError() is at
+									// most this get no more samples
+		int maxSamples;				// per pixel
+	};
+
+	// How a render ended
+	enum Outcome
+	{
+		FINISHED,		// every pixel is good enough, or has all its samples
+		OUT_OF_TIME,
+		OUT_OF_RAYS,
+		STOPPED,		// by cancel() or the poll function
+		NUM_OUTCOMES
+	};
+	static const char* outcomeName(Outcome outcome);
+
+	// Called every few milliseconds while rendering, on the thread that
+	// called render(); returning false stops the render.
+	typedef bool(*pollFunc)(BudgetedRender* render, void* arg);
+
+	// Render with job on the workers of pool.
+	BudgetedRender(WorkerPool& pool, RenderJob& job);
+
+	// Render the scene loaded in tracer at width x height, with settings
+	// except for antialiasing, which the extra samples take the place of.
+	// Returns once the frame is done, leaving it in tracer's buffer.
+	Outcome render(RayTracer* tracer, int width, int height, const RenderSettings& settings,
+		const Budget& budget, pollFunc poll = NULL, void* arg = NULL);
+
+	// Stop the render as soon as possible.  Safe to call from any thread.
+	void cancel() { cancelled.store(true); }
+
+	// How the render is going, or how the last one went
+	int		rounds() const { return numRounds; }
+	double	elapsed() const;
+	unsigned long long raysTraced() const;
+	// Whether every pixel has been traced at least once
+	bool	whole() const { return wholeFrame; }
+
+	// Samples per pixel, and the error (see RayTracer::pixelError()) of
+	// the worst pixel that has more than one, once render() is done.
+	double	samplesPerPixel() const { return meanSamples; }
+	int		minSamples() const { return fewestSamples; }
+	int		maxSamples() const { return mostSamples; }
+	double	worstError() const { return maxError; }
+
+	// Samples every pixel gets before the rounds start, and the samples a
+	// pixel gets in each round it is picked for.
+	static const int FIRST_SAMPLES = 4;
+	static const int ROUND_SAMPLES = 4;
+
+private:
+	BudgetedRender(const BudgetedRender&);
+	BudgetedRender& operator=(const BudgetedRender&);
+
+	// Wait for the job, stopping it if the budget runs out; false if it
+	// did, with outcome saying why.
+	bool waitForJob(const Budget& budget, pollFunc poll, void* arg);
+	// What the next round should pick; false if there is nothing left to do.
+	bool nextRound(RayTracer* tracer, const Budget& budget, RenderJob::Refinement& r);
+	void measure(RayTracer* tracer);
+
+	typedef std::chrono::steady_clock clock;
+
+	WorkerPool& pool;
+	RenderJob& job;
+	std::atomic<bool> cancelled;
+	Outcome outcome;
+	int width, height;
+	int numRounds;
+	bool wholeFrame;
+	clock::time_point startTime, endTime;
+	bool running;
+	unsigned long long raysAtStart, raysAtEnd;
+	double meanSamples;
+	int fewestSamples, mostSamples;
+	double maxError;
+};
+
+#endif
@@ -6,15 +6,16 @@
 #include "scene/light.h"
 #include "scene/material.h"
 #include "scene/ray.h"
+#include "scene/hbv.h"
+#include "scene/raystats.h"
 
 #include "parser/Tokenizer.h"
 #include "parser/Parser.h"
 
-#include "ui/TraceUI.h"
 #include <cmath>
+#include <cstring>
 #include <algorithm>
 
-extern TraceUI* traceUI;
 
 #include <iostream>
 #include <fstream>
@@ -30,29 +31,41 @@ bool debugMode = false;
 // through the projection plane, and out into the scene.  All we do is
 // enter the main ray-tracing method, getting things started by plugging
 // in an initial ray weight of (0.0,0.0,0.0) and an initial recursion depth of 0.
+// The colour isn't clamped: anything over 1 is left for tone mapping (see
+// toneMapPixel()) to deal with, after it has been averaged with the rest of
+// the pixel's samples.
 Vec3d RayTracer::trace( double x, double y )
 {
-	// Clear out the ray cache in the scene for debugging purposes,
-	if (!traceUI->isMultithreading())
-		scene->intersectCache.clear();
+	// Clear out the rays captured for debugging purposes,
+	RayCapture &capture = RayCapture::local();
+	if (capture.enabled())
+		capture.clear();
 
     ray r( Vec3d(0,0,0), Vec3d(0,0,0), ray::VISIBILITY );
 
     scene->getCamera().rayThrough( x,y,r );
-	Vec3d ret = traceRay( r, Vec3d(1.0,1.0,1.0), 0 );
-	ret.clamp();
-	return ret;
+	return traceRay( r, Vec3d(1.0,1.0,1.0), 0 );
+}
+
+// The most a colour weighted by w can add up to in any channel.
+static inline double maxComponent( const Vec3d& w )
+{
+	return max( w[0], max( w[1], w[2] ) );
 }
 
 // Do recursive ray tracing!  You'll want to insert a lot of code here
 // (or places called from here) to handle reflection, refraction, etc etc.
+// thresh is what the colour r brings back gets multiplied by on its way to
+// the pixel: (1,1,1) for a ray from the camera, times kr or kt at every
+// bounce.  Reflected and refracted rays whose weight would fall below
+// settings.cutoff in every channel aren't traced at all.
 Vec3d RayTracer::traceRay( const ray& r, 
 	const Vec3d& thresh, int depth )
 {
 	isect i;
 	double n_i, n_t;
 	Vec3d Q, I, tempD;
-	int depthLeft = traceUI->getDepth() - depth;
+	int depthLeft = settings.depth - depth;
 
 	if (scene->intersect(r, i)) {
 
@@ -60,14 +73,17 @@ Vec3d RayTracer::traceRay( const ray& r,
 
 		const Material& m = i.getMaterial();
 		I = m.shade(scene, r, i);
-		depthLeft = traceUI->getDepth() - depth;
+		depthLeft = settings.depth - depth;
 		if (depthLeft > 0){
-			if (m.kr(i).length() > 0){
+			Vec3d kr = m.kr(i), kt = m.kt(i);
+			Vec3d reflected = prod(thresh, kr), refracted = prod(thresh, kt);
+
+			if (kr.length() > 0 && maxComponent(reflected) >= settings.cutoff){
 				Vec3d R = reflectDirection(i.N, -r.getDirection());
 
 				ray r_reflection(Q, R, ray::REFLECTION);
 
-				I = I + prod(m.kr(i), traceRay(r_reflection, thresh, depth + 1));
+				I = I + prod(kr, traceRay(r_reflection, reflected, depth + 1));
 
 			}
 			
@@ -78,13 +94,13 @@ Vec3d RayTracer::traceRay( const ray& r,
 				n_i = m.index(i); n_t = 1.003;  tempD = -i.N;
 			}
 
-			if ((notTIR(n_i, n_t, -r.getDirection(), i.N) & (m.kt(i).length()>0))){
+			if ((notTIR(n_i, n_t, -r.getDirection(), i.N) & (kt.length()>0)) && maxComponent(refracted) >= settings.cutoff){
 
 				Vec3d T = refractDirection(n_i, n_t, tempD, r.getDirection());
 				ray::RayType type = ray::REFRACTION;
 				if ((r.getDirection()* i.N) > 0) type = ray::VISIBILITY;
 				ray r_refraction(Q, T, type);     // The incoming ray from the first lens layer is not intersecting with the second wall of the same lens. It bounced back from the other objects.
-				I = I + prod(m.kt(i), traceRay(r_refraction, thresh, depth));
+				I = I + prod(kt, traceRay(r_refraction, refracted, depth));
 			}
 		}
 		return I;
@@ -95,7 +111,8 @@ Vec3d RayTracer::traceRay( const ray& r,
 }
 
 RayTracer::RayTracer()
-	: scene( 0 ), buffer( 0 ), buffer_width( 0 ), buffer_height( 0 ), m_bBufferReady( false )
+	: buffer( 0 ), buffer_width( 0 ), buffer_height( 0 ), scene( 0 ),
+	  corners( 0 ), cornerState( 0 ), numCorners( 0 ), samples( 0 ), m_bBufferReady( false )
 {
 }
 
@@ -104,6 +121,9 @@ RayTracer::~RayTracer()
 {
 	delete scene;
 	delete [] buffer;
+	delete [] corners;
+	delete [] cornerState;
+	delete [] samples;
 }
 
 void RayTracer::getBuffer( unsigned char *&buf, int &w, int &h )
@@ -113,6 +133,11 @@ void RayTracer::getBuffer( unsigned char *&buf, int &w, int &h )
 	h = buffer_height;
 }
 
+Camera& RayTracer::getCamera()
+{
+	return scene->getCamera();
+}
+
 double RayTracer::aspectRatio()
 {
 	return sceneLoaded() ? scene->getCamera().getAspectRatio() : 1;
@@ -120,11 +145,17 @@ double RayTracer::aspectRatio()
 
 bool RayTracer::loadScene( const char* fn )
 {
+	return loadScene( fn, HBVBuildOptions() );
+}
+
+bool RayTracer::loadScene( const char* fn, const HBVBuildOptions& options )
+{
+	error.clear();
+
 	ifstream ifs( fn );
 	if( !ifs ) {
-		string msg( "Error: couldn't read scene file " );
-		msg.append( fn );
-		traceUI->alert( msg );
+		error = "Error: couldn't read scene file ";
+		error.append( fn );
 		return false;
 	}
 	
@@ -144,19 +175,17 @@ bool RayTracer::loadScene( const char* fn )
 		scene = parser.parseScene();
 	} 
 	catch( SyntaxErrorException& pe ) {
-		traceUI->alert( pe.formattedMessage() );
+		error = pe.formattedMessage();
 		return false;
 	}
 	catch( ParserException& pe ) {
-		string msg( "Parser: fatal exception " );
-		msg.append( pe.message() );
-		traceUI->alert( msg );
+		error = "Parser: fatal exception ";
+		error.append( pe.message() );
 		return false;
 	}
 	catch( TextureMapException e ) {
-		string msg( "Texture mapping exception: " );
-		msg.append( e.message() );
-		traceUI->alert( msg );
+		error = "Texture mapping exception: ";
+		error.append( e.message() );
 		return false;
 	}
 
@@ -164,14 +193,18 @@ bool RayTracer::loadScene( const char* fn )
 	if( ! sceneLoaded() )
 		return false;
 
-	scene->indexObjects();
+	scene->indexObjects( options );
 
 	
 	return true;
 }
 
-void RayTracer::traceSetup( int w, int h )
+void RayTracer::traceSetup( int w, int h, const RenderSettings& s )
 {
+	settings = s;
+	if( sceneLoaded() )
+		scene->setAccelerated( settings.accelerate );
+
 	if( buffer_width != w || buffer_height != h )
 	{
 		buffer_width = w;
@@ -180,16 +213,54 @@ void RayTracer::traceSetup( int w, int h )
 		bufferSize = buffer_width * buffer_height * 3;
 		delete [] buffer;
 		buffer = new unsigned char[ bufferSize ];
+		delete [] samples;
+		samples = new PixelSamples[ w*h ];
 
 	}
 	memset( buffer, 0, w*h*3 );
+	std::fill( samples, samples + w*h, PixelSamples() );
 	m_bBufferReady = true;
 
+	// Adaptive antialiasing starts the frame with no corners traced
+	if( settings.antialias && settings.aaDepth > 0 )
+	{
+		int n = ( w + 1 ) * ( h + 1 );
+		if( n != numCorners )
+		{
+			delete [] corners;
+			delete [] cornerState;
+			corners = new Vec3f[ n ];
+			cornerState = new std::atomic<unsigned char>[ n ];
+			numCorners = n;
+		}
+		for( int k = 0; k < n; ++k )
+			cornerState[k].store( CORNER_EMPTY, std::memory_order_relaxed );
+	}
+
 	//callTracePixel_ptr = &tracePixel;
 	//callTracePixel_ptr cb_tracer = &RayTracer::tracePixel;
 	//set_cb_tracer(cb_tracer);
 }
 
+void RayTracer::renderPixel( int i, int j )
+{
+	if( settings.antialias && settings.aaDepth > 0 )
+		tracePixelAdaptive( i, j );
+	else if( settings.antialias )
+		tracePixelAntiAlias( i, j );
+	else
+		tracePixel( i, j );
+}
+
+void RayTracer::renderRegion( int x0, int y0, int x1, int y1, unsigned char* out, int rowStride )
+{
+	for( int j = y0; j < y1; ++j ) {
+		for( int i = x0; i < x1; ++i )
+			renderPixel( i, j );
+		memcpy( out + (j - y0) * rowStride, buffer + ( x0 + j * buffer_width ) * 3, (x1 - x0) * 3 );
+	}
+}
+
 void RayTracer::tracePixel( int i, int j )
 {
 	Vec3d col;
@@ -202,11 +273,28 @@ void RayTracer::tracePixel( int i, int j )
 
 	col = trace( x, y);
 
-	unsigned char *pixel = buffer + ( i + j * buffer_width ) * 3;
+	setPixel( i, j, col );
+}
+
+void RayTracer::tracePixelBlock( int i, int j, int w, int h )
+{
+	tracePixel( i, j );
+
+	// The painted pixels get the colour but not the sample
+	PixelSamples painted;
+	painted.sum = samples[ i + j * buffer_width ].sum;
 
-	pixel[0] = (int)( 255.0 * col[0]);
-	pixel[1] = (int)( 255.0 * col[1]);
-	pixel[2] = (int)( 255.0 * col[2]);
+	unsigned char *pixel = buffer + ( i + j * buffer_width ) * 3;
+	for( int y = 0; y < h; ++y )
+	{
+		unsigned char *row = pixel + y * buffer_width * 3;
+		PixelSamples *rowSamples = samples + i + ( j + y ) * buffer_width;
+		for( int x = ( y == 0 ? 1 : 0 ); x < w; ++x )
+		{
+			memcpy( row + x * 3, pixel, 3 );
+			rowSamples[x] = painted;
+		}
+	}
 }
 
 void RayTracer::tracePixelAntiAlias(int i, int j)
@@ -218,24 +306,211 @@ void RayTracer::tracePixelAntiAlias(int i, int j)
 	if (!sceneLoaded())
 		return;
 
+	int k = i + j * buffer_width;
+	samples[k].count = 0;
+
 	double space = 1 / subsamplrate;
 	double xa, ya;
 	for (int numX = 0; numX < subsamplrate; numX++){
 		for (int numY = 0; numY < subsamplrate; numY++){
 			xa = ((double(i) - 0.5) + space / 2 + double(numX)*space) / double(buffer_width);
 			ya = ((double(j) - 0.5) + space / 2 + double(numY)*space) / double(buffer_height);
-			col += trace(xa, ya);
+			Vec3d sample = trace(xa, ya);
+			accumulate(k, sample);
+			col += sample;
 		}
 	}
 
+	toneMapPixel(k, col / subsamplrate / subsamplrate);
+}
 
-	
+Vec3d RayTracer::traceSubpixel( double x, double y )
+{
+	return trace( x / double(buffer_width), y / double(buffer_height) );
+}
+
+Vec3d RayTracer::traceCorner( int ci, int cj )
+{
+	int k = ci + cj * ( buffer_width + 1 );
+	std::atomic<unsigned char>& state = cornerState[k];
+	if( state.load( std::memory_order_acquire ) != CORNER_DONE )
+	{
+		unsigned char empty = CORNER_EMPTY;
+		bool mine = state.compare_exchange_strong( empty, CORNER_BUSY, std::memory_order_relaxed );
+		// Pixel (i,j) is centred on (i,j), so its corners are half a pixel off
+		Vec3d col = traceSubpixel( ci - 0.5, cj - 0.5 );
+		if( !mine )
+			// Round it the same as the stored copy, so the pixels on either
+			// side of the corner come out the same whoever traced it
+			return Vec3d( (float)col[0], (float)col[1], (float)col[2] );
+		corners[k] = Vec3f( (float)col[0], (float)col[1], (float)col[2] );
+		state.store( CORNER_DONE, std::memory_order_release );
+	}
+	const Vec3f& c = corners[k];
+	return Vec3d( c[0], c[1], c[2] );
+}
+
+Vec3d RayTracer::subdivide( double x, double y, double size, const Vec3d c[4], int depth )
+{
+	// Compared clipped to 0-1, so two corners that are both too bright to
+	// show (at the default exposure) need no more rays between them
+	bool flat = true;
+	for( int k = 0; k < 3 && flat; ++k )
+	{
+		double lo = min( min( c[0][k], c[1][k] ), min( c[2][k], c[3][k] ) );
+		double hi = max( max( c[0][k], c[1][k] ), max( c[2][k], c[3][k] ) );
+		flat = min( hi, 1.0 ) - min( lo, 1.0 ) <= settings.aaContrast;
+	}
+	if( flat || depth <= 0 )
+		return ( c[0] + c[1] + c[2] + c[3] ) / 4.0;
+
+	// Trace the middles of the sides and of the square, and do each quarter
+	double half = size / 2;
+	Vec3d bottom = traceSubpixel( x + half, y ), top = traceSubpixel( x + half, y + size );
+	Vec3d left = traceSubpixel( x, y + half ), right = traceSubpixel( x + size, y + half );
+	Vec3d middle = traceSubpixel( x + half, y + half );
+
+	Vec3d bl[4] = { c[0], bottom, left, middle }, br[4] = { bottom, c[1], middle, right };
+	Vec3d tl[4] = { left, middle, c[2], top }, tr[4] = { middle, right, top, c[3] };
+	return ( subdivide( x, y, half, bl, depth - 1 ) + subdivide( x + half, y, half, br, depth - 1 )
+		+ subdivide( x, y + half, half, tl, depth - 1 ) + subdivide( x + half, y + half, half, tr, depth - 1 ) ) / 4.0;
+}
+
+void RayTracer::tracePixelAdaptive( int i, int j )
+{
+	if( !sceneLoaded() )
+		return;
+
+	Vec3d c[4] = { traceCorner( i, j ), traceCorner( i + 1, j ), traceCorner( i, j + 1 ), traceCorner( i + 1, j + 1 ) };
+	Vec3d col = subdivide( i - 0.5, j - 0.5, 1.0, c, settings.aaDepth );
+
+	setPixel( i, j, col );
+}
+
+// Brightness, as the eye sees it
+static inline double luminance( const Vec3d& c )
+{
+	return 0.299 * c[0] + 0.587 * c[1] + 0.114 * c[2];
+}
+
+// The digits of k in the given base, mirrored around the point: the
+// Halton sequence, which spreads points evenly however many are taken.
+static double radicalInverse( int k, int base )
+{
+	double x = 0, digit = 1.0 / base;
+	for( ; k > 0; k /= base, digit /= base )
+		x += ( k % base ) * digit;
+	return x;
+}
+
+// A fixed offset in [0,1) for each pixel, so neighbouring pixels don't
+// all put their samples in the same places.
+static double pixelOffset( int i, int j, unsigned int salt )
+{
+	unsigned int h = (unsigned int)i * 73856093u ^ (unsigned int)j * 19349663u ^ salt;
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	h *= 0x846ca68bu;
+	h ^= h >> 16;
+	return h / 4294967296.0;
+}
+
+void RayTracer::toneMapPixel( int k, const Vec3d& col )
+{
+	unsigned char *pixel = buffer + k * 3;
+	for( int c = 0; c < 3; ++c )
+	{
+		double v = max( col[c] * settings.exposure, 0.0 );
+		if( settings.toneMap == RenderSettings::REINHARD )
+			v = v / ( 1.0 + v );
+		else if( v > 1.0 )
+			v = 1.0;
+		pixel[c] = (int)( 255.0 * v );
+	}
+}
 
-	unsigned char *pixel = buffer + (i + j * buffer_width) * 3;
+void RayTracer::accumulate( int k, const Vec3d& col )
+{
+	PixelSamples& s = samples[k];
+	if( s.count == 0 )
+		s = PixelSamples();
+	s.sum += Vec3f( (float)col[0], (float)col[1], (float)col[2] );
+	double y = luminance( Vec3d( min( col[0], 1.0 ), min( col[1], 1.0 ), min( col[2], 1.0 ) ) );
+	s.sumY += (float)y;
+	s.sumY2 += (float)( y * y );
+	s.count++;
+}
 
-	pixel[0] = (int)(255.0 * col[0] / subsamplrate / subsamplrate);
-	pixel[1] = (int)(255.0 * col[1] / subsamplrate / subsamplrate);
-	pixel[2] = (int)(255.0 * col[2] / subsamplrate / subsamplrate);
+void RayTracer::addSample( int i, int j, const Vec3d& col )
+{
+	int k = i + j * buffer_width;
+	accumulate( k, col );
+	toneMapPixel( k, pixelColor( i, j ) );
+}
+
+void RayTracer::setPixel( int i, int j, const Vec3d& col )
+{
+	int k = i + j * buffer_width;
+	samples[k].count = 0;
+	accumulate( k, col );
+	// From col itself rather than the float copy of it, so a pixel with
+	// one sample comes out exactly as it was traced
+	toneMapPixel( k, col );
+}
+
+void RayTracer::samplePixel( int i, int j, int n )
+{
+	if( !sceneLoaded() )
+		return;
+
+	double offsetX = pixelOffset( i, j, 0x9e3779b9u ), offsetY = pixelOffset( i, j, 0x7f4a7c15u );
+	for( int m = 0; m < n; ++m )
+	{
+		// The first sample is tracePixel()'s; the rest follow the Halton
+		// sequence, shifted (wrapping around) by the pixel's own offset
+		int k = samples[ i + j * buffer_width ].count;
+		double x = 0.5, y = 0.5;
+		if( k > 0 )
+		{
+			x = radicalInverse( k, 2 ) + offsetX;
+			y = radicalInverse( k, 3 ) + offsetY;
+			x -= floor( x );
+			y -= floor( y );
+		}
+		addSample( i, j, traceSubpixel( i - 0.5 + x, j - 0.5 + y ) );
+	}
+}
+
+int RayTracer::pixelSamples( int i, int j ) const
+{
+	return samples[ i + j * buffer_width ].count;
+}
+
+Vec3d RayTracer::pixelColor( int i, int j ) const
+{
+	const PixelSamples& s = samples[ i + j * buffer_width ];
+	Vec3d sum( s.sum[0], s.sum[1], s.sum[2] );
+	return s.count > 1 ? sum / s.count : sum;
+}
+
+double RayTracer::pixelError( int i, int j ) const
+{
+	const PixelSamples& s = samples[ i + j * buffer_width ];
+	if( s.count < 2 )
+		return HUGE_VAL;
+	double mean = double( s.sumY ) / s.count;
+	double variance = ( s.sumY2 - s.count * mean * mean ) / ( s.count - 1 );
+	return variance > 0 ? sqrt( variance / s.count ) : 0.0;
+}
+
+void RayTracer::toneMap( RenderSettings::ToneMap op, double exposure )
+{
+	settings.toneMap = op;
+	settings.exposure = exposure;
+	for( int j = 0; j < buffer_height; ++j )
+		for( int i = 0; i < buffer_width; ++i )
+			toneMapPixel( i + j * buffer_width, pixelColor( i, j ) );
 }
 
 /*void RayTracer::set_cb_tracer(callTracePixel_ptr ptr){
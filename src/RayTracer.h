@@ -2,12 +2,23 @@
 #define __RAYTRACER_H__
 
 // The main ray tracer.
+//
+// This, RenderJob.h and what they use make up libraytrace (see the
+// Makefile), which needs no UI.  Programs that link the headless build of
+// it must be compiled with COMMAND_LINE_ONLY defined as well, since that
+// leaves the OpenGL drawing out of the scene classes.
+
+#include <atomic>
+#include <string>
 
 #include "scene/ray.h"
+#include "RenderSettings.h"
 
 #define THREAD_CHUNKSIZE 32
 
 class Scene;
+class Camera;
+struct HBVBuildOptions;
 
 class RayTracer
 {
@@ -21,10 +32,47 @@ public:
 
 	void getBuffer( unsigned char *&buf, int &w, int &h );
 	double aspectRatio();
-	void traceSetup( int w, int h );
+	// Get ready to render a w x h frame with the given settings, which
+	// hold until the next call.
+	void traceSetup( int w, int h, const RenderSettings& settings );
+	const RenderSettings& getSettings() const { return settings; }
+	// Trace pixel (i,j) into the buffer, antialiased if the settings say so.
+	void renderPixel( int i, int j );
 	void tracePixel( int i, int j );
+	// Trace pixel (i,j) and paint the w x h block of pixels from it up and
+	// to the right with it, for a quick preview of the frame.
+	void tracePixelBlock( int i, int j, int w, int h );
+	// Supersample pixel (i,j) on a fixed 3x3 grid,
 	void tracePixelAntiAlias(int i, int j);
-	bool Antialias;
+	// or adaptively (see RenderSettings::aaDepth).
+	void tracePixelAdaptive( int i, int j );
+	// Render the pixels [x0,x1) x [y0,y1) of the frame set up by
+	// traceSetup() on the calling thread, and copy them out as rows of RGB
+	// bytes, rowStride bytes apart, starting at out.  Several threads can
+	// render at once as long as their regions don't overlap.
+	void renderRegion( int x0, int y0, int x1, int y1, unsigned char* out, int rowStride );
+
+	// Samples.  Every pixel keeps the samples traced for it this frame,
+	// summed up as floats, in a framebuffer of its own; the 8 bit buffer
+	// getBuffer() returns is their mean, tone mapped as the settings say.
+	// tracePixel() traces a pixel's first sample, through its centre,
+	// samplePixel() adds n more spread over the pixel (for rendering to a
+	// budget, see BudgetedRender.h) without tracing the others again, and
+	// the samples of a pixel come out the same whatever order pixels and
+	// samples are traced in.  A pixel antialiased on the 3x3 grid has
+	// those nine samples; one antialiased adaptively counts as one.
+	void samplePixel( int i, int j, int n );
+	int pixelSamples( int i, int j ) const;
+	// The mean of the pixel's samples, before tone mapping
+	Vec3d pixelColor( int i, int j ) const;
+	// Standard error of the pixel's mean brightness, from how much its
+	// samples differ; HUGE_VAL while it has fewer than two.
+	double pixelError( int i, int j ) const;
+	// Tone map the whole frame again, from the samples it has, with
+	// another operator or exposure, which then hold for the rest of it;
+	// a cheap way to change how it looks without tracing it again.  Not
+	// while anything is rendering into it.
+	void toneMap( RenderSettings::ToneMap op, double exposure );
 	void(RayTracer::*callTracePixel_ptr)(int, int) const = NULL;
 	//callTracePixel_ptr cb_tracer;
 	//void(*ptrTracePixel)(int, int);
@@ -32,7 +80,10 @@ public:
 	Vec3d reflectDirection(const Vec3d& N, const Vec3d& d) const;
 	Vec3d refractDirection(const double n_i, const double n_t, const Vec3d& N, const Vec3d& d) const;
 
+	// Load a scene and build its bvh; on failure, getError() says why.
 	bool loadScene( const char* fn );
+	bool loadScene( const char* fn, const HBVBuildOptions& options );
+	const std::string& getError() const { return error; }
 
 	bool sceneLoaded() { return scene != 0; }
 
@@ -45,12 +96,60 @@ public:
       { return m_bBufferReady; }
 
 	const Scene& getScene() { return *scene; }
+	Camera& getCamera();
 
 private:
+	// Adaptive antialiasing: the colour through corner (ci,cj) of the pixel
+	// grid, which is the bottom left corner of pixel (ci,cj), traced the
+	// first time a pixel next to it asks for it;
+	Vec3d traceCorner( int ci, int cj );
+	// the colour through a point in pixel coordinates;
+	Vec3d traceSubpixel( double x, double y );
+	// and the colour of the size x size square with its bottom left corner
+	// at (x,y) whose corners (bottom left, bottom right, top left, top right)
+	// are c, after splitting it up depth more times at most.
+	Vec3d subdivide( double x, double y, double size, const Vec3d c[4], int depth );
+
 	unsigned char *buffer;
 	int buffer_width, buffer_height;
 	int bufferSize;
 	Scene* scene;
+	RenderSettings settings;
+	std::string error;
+
+	// Colours traced through the (w+1) x (h+1) pixel corners so far this
+	// frame, for adaptive antialiasing.  Any number of threads can ask for
+	// corners at once; whoever gets to an empty corner first claims it
+	// (CORNER_BUSY), traces it and publishes it (CORNER_DONE), and anyone
+	// who finds it busy meanwhile just traces it as well rather than wait.
+	enum { CORNER_EMPTY, CORNER_BUSY, CORNER_DONE };
+	Vec3f* corners;
+	std::atomic<unsigned char>* cornerState;
+	int numCorners;
+
+	// The samples of a pixel, in the framebuffer.  Brightnesses are of
+	// the samples clipped to 0-1, as they would be shown, so that a few
+	// very bright ones don't make a pixel look noisier than it is.  A
+	// pixel with no samples yet (only painted by tracePixelBlock()) has
+	// its colour in sum.
+	struct PixelSamples
+	{
+		PixelSamples() : sumY( 0 ), sumY2( 0 ), count( 0 ) { }
+
+		Vec3f sum;
+		float sumY;			// brightnesses, summed
+		float sumY2;		// and squared, summed
+		int count;
+	};
+	// Add a sample to pixel k, starting it over if it had none
+	void accumulate( int k, const Vec3d& col );
+	// ...and tone map the pixel's new mean into the 8 bit buffer
+	void addSample( int i, int j, const Vec3d& col );
+	// Start pixel (i,j) over with col as its only sample
+	void setPixel( int i, int j, const Vec3d& col );
+	// Tone map col into pixel k of the 8 bit buffer
+	void toneMapPixel( int k, const Vec3d& col );
+	PixelSamples* samples;
 
     bool m_bBufferReady;
 
@@ -0,0 +1,305 @@
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#endif
+
+#include "RenderFarm.h"
+
+// Bands are cut so each worker gets about this many, so one slow band near
+// the end doesn't leave the rest idle for long.
+static const int BANDS_PER_WORKER = 8;
+
+RenderFarm::RenderFarm()
+	: numRetries(0), numRays(0), bandHeight(1), imageHeight(0), bandsLeft(0)
+{
+}
+
+RenderFarm::~RenderFarm() {
+	stop();
+}
+
+int RenderFarm::size() const {
+	int n = 0;
+	for (size_t i = 0; i < workers.size(); i++) {
+		if (workers[i].fd >= 0)
+			n++;
+	}
+	return n;
+}
+
+void RenderFarm::retry(int band, const std::string& why) {
+	if (attempts[band] >= MAX_ATTEMPTS) {
+		if (error.empty()) {
+			std::ostringstream s;
+			int y0 = band * bandHeight, y1 = y0 + bandHeight < imageHeight ? y0 + bandHeight : imageHeight;
+			s << "rows " << y0 << "-" << y1 << " failed " << attempts[band] << " times: " << why;
+			error = s.str();
+		}
+		return;
+	}
+	numRetries++;
+	todo.push_back(band);
+}
+
+#ifndef WIN32
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+bool RenderFarm::start(const char* program, const std::vector<std::string>& args, int numWorkers) {
+	stop();
+	error.clear();
+
+	std::vector<char*> argv;
+	argv.push_back((char*)program);
+	argv.push_back((char*)"-D");
+	for (size_t i = 0; i < args.size(); i++)
+		argv.push_back((char*)args[i].c_str());
+	argv.push_back(NULL);
+
+	for (int i = 0; i < numWorkers; i++) {
+		int sv[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+			error = std::string("can't make a socket for a render worker: ") + strerror(errno);
+			break;
+		}
+		pid_t pid = fork();
+		if (pid < 0) {
+			error = std::string("can't start a render worker: ") + strerror(errno);
+			close(sv[0]);
+			close(sv[1]);
+			break;
+		}
+		if (pid == 0) {
+			// The worker reads requests on stdin and answers on stdout
+			dup2(sv[1], 0);
+			dup2(sv[1], 1);
+			close(sv[0]);
+			close(sv[1]);
+			execvp(program, &argv[0]);
+			fprintf(stderr, "can't run %s: %s\n", program, strerror(errno));
+			_exit(127);
+		}
+
+		close(sv[1]);
+		// Later workers mustn't hold on to this one's socket
+		fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+#if !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+		int on = 1;
+		setsockopt(sv[0], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+		Worker worker;
+		worker.pid = pid;
+		worker.fd = sv[0];
+		worker.band = -1;
+		workers.push_back(worker);
+	}
+	return !workers.empty();
+}
+
+void RenderFarm::stop() {
+	// A worker exits once its stdin runs out
+	for (size_t i = 0; i < workers.size(); i++) {
+		if (workers[i].fd >= 0) {
+			close(workers[i].fd);
+			waitpid(workers[i].pid, NULL, 0);
+		}
+	}
+	workers.clear();
+}
+
+void RenderFarm::lose(Worker& worker) {
+	kill(worker.pid, SIGKILL);
+	close(worker.fd);
+	waitpid(worker.pid, NULL, 0);
+	worker.fd = -1;
+	worker.inbox.clear();
+	if (worker.band >= 0)
+		retry(worker.band, "render worker died");
+	worker.band = -1;
+}
+
+void RenderFarm::receive(Worker& worker, int width, unsigned char* buf) {
+	size_t eol = worker.inbox.find('\n');
+	if (eol == std::string::npos)
+		return;
+	std::string header = worker.inbox.substr(0, eol);
+
+	if (header.compare(0, 6, "error ") == 0) {
+		int band = worker.band;
+		worker.band = -1;
+		worker.inbox.erase(0, eol + 1);
+		retry(band, header.substr(6));
+		return;
+	}
+
+	int y0 = worker.band * bandHeight, y1 = y0 + bandHeight < imageHeight ? y0 + bandHeight : imageHeight;
+	size_t bytes = (size_t)width * (y1 - y0) * 3;
+	size_t at = header.find(" bytes=");
+	if (header.compare(0, 3, "ok ") != 0 || at == std::string::npos
+		|| strtoul(header.c_str() + at + 7, NULL, 10) != bytes) {
+		// Can't make sense of it, so it can't be trusted with more work
+		lose(worker);
+		return;
+	}
+	if (worker.inbox.size() < eol + 1 + bytes)
+		return;
+
+	size_t rays = header.find(" rays=");
+	if (rays != std::string::npos)
+		numRays += strtoull(header.c_str() + rays + 6, NULL, 10);
+	memcpy(buf + (size_t)y0 * width * 3, worker.inbox.data() + eol + 1, bytes);
+	worker.inbox.erase(0, eol + 1 + bytes);
+	worker.band = -1;
+	bandsLeft--;
+}
+
+bool RenderFarm::render(const std::string& scene, int width, int height,
+	const RenderSettings& settings, unsigned char* buf)
+{
+	error.clear();
+	numRetries = 0;
+	numRays = 0;
+	for (size_t c = 0; c < scene.size(); c++) {
+		if (isspace((unsigned char)scene[c])) {
+			error = "render workers can't load scene files with spaces in their paths";
+			return false;
+		}
+	}
+	int n = size();
+	if (n == 0) {
+		error = "no render workers running";
+		return false;
+	}
+
+	imageHeight = height;
+	bandHeight = (height + n * BANDS_PER_WORKER - 1) / (n * BANDS_PER_WORKER);
+	if (bandHeight < 1)
+		bandHeight = 1;
+	int bands = (height + bandHeight - 1) / bandHeight;
+	todo.clear();
+	for (int b = bands - 1; b >= 0; b--)
+		todo.push_back(b);
+	attempts.assign(bands, 0);
+	bandsLeft = bands;
+
+	std::vector<struct pollfd> fds;
+	std::vector<Worker*> polled;
+	char chunk[65536];
+	for (;;) {
+		// Keep every worker busy with one band, unless the render has failed
+		for (size_t i = 0; i < workers.size(); i++) {
+			Worker& worker = workers[i];
+			if (worker.fd < 0 || worker.band >= 0 || todo.empty() || !error.empty())
+				continue;
+			worker.band = todo.back();
+			todo.pop_back();
+			attempts[worker.band]++;
+
+			int y0 = worker.band * bandHeight, y1 = y0 + bandHeight < height ? y0 + bandHeight : height;
+			std::ostringstream request;
+			request << "render scene=" << scene << " width=" << width << " height=" << height
+				<< " depth=" << settings.depth << " cutoff=" << settings.cutoff << " aa=" << (settings.antialias ? 1 : 0)
+				<< " aa_depth=" << settings.aaDepth << " aa_contrast=" << settings.aaContrast
+				<< " accel=" << (settings.accelerate ? 1 : 0) << " tonemap=" << RenderSettings::toneMapName(settings.toneMap) << " exposure=" << settings.exposure
+				<< " region=0," << y0 << "," << width << "," << y1 << " out=-\n";
+			std::string line = request.str();
+			for (size_t sent = 0; sent < line.size(); ) {
+				ssize_t k = send(worker.fd, line.data() + sent, line.size() - sent, SEND_FLAGS);
+				if (k < 0 && errno == EINTR)
+					continue;
+				if (k <= 0) {
+					lose(worker);
+					break;
+				}
+				sent += k;
+			}
+		}
+
+		// ...and wait for whatever any of them has to say.  Once the render
+		// has failed this only drains the replies still to come, so the
+		// workers are ready for the next one.
+		fds.clear();
+		polled.clear();
+		for (size_t i = 0; i < workers.size(); i++) {
+			if (workers[i].fd >= 0 && workers[i].band >= 0) {
+				struct pollfd p;
+				p.fd = workers[i].fd;
+				p.events = POLLIN;
+				p.revents = 0;
+				fds.push_back(p);
+				polled.push_back(&workers[i]);
+			}
+		}
+		if (fds.empty())
+			break;
+		if (poll(&fds[0], fds.size(), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			error = std::string("can't wait for the render workers: ") + strerror(errno);
+			for (size_t i = 0; i < polled.size(); i++)
+				lose(*polled[i]);
+			break;
+		}
+
+		for (size_t i = 0; i < fds.size(); i++) {
+			if (!fds[i].revents)
+				continue;
+			ssize_t k = recv(fds[i].fd, chunk, sizeof(chunk), 0);
+			if (k < 0 && errno == EINTR)
+				continue;
+			if (k <= 0) {
+				lose(*polled[i]);
+				continue;
+			}
+			polled[i]->inbox.append(chunk, k);
+			receive(*polled[i], width, buf);
+		}
+	}
+
+	if (error.empty() && bandsLeft > 0)
+		error = "all the render workers died";
+	return error.empty();
+}
+
+#else
+
+// No fork() here; the methods that use it just fail.
+
+bool RenderFarm::start(const char* program, const std::vector<std::string>& args, int numWorkers) {
+	error = "render worker processes aren't supported on this system";
+	return false;
+}
+
+void RenderFarm::stop() {
+}
+
+void RenderFarm::lose(Worker& worker) {
+}
+
+void RenderFarm::receive(Worker& worker, int width, unsigned char* buf) {
+}
+
+bool RenderFarm::render(const std::string& scene, int width, int height,
+	const RenderSettings& settings, unsigned char* buf)
+{
+	error = "no render workers running";
+	return false;
+}
+
+#endif
@@ -0,0 +1,93 @@
+// RenderFarm.h
+// Renders a frame on several local worker processes instead of (or as well
+// as) threads.  Each worker is a copy of the ray tracer running as a
+// RenderServer ("ray -D") on the other end of a socket, so it loads each
+// scene once and then renders as many pieces of it as it is sent.  The
+// frame is cut into bands of rows, each worker is kept busy with one band
+// at a time, and the bands come back as raw pixels (out=-, see
+// RenderServer.h) straight into the caller's buffer.
+//
+// A band whose worker dies, or answers with an error, goes back on the
+// queue for another worker; only when a band has failed MAX_ATTEMPTS times,
+// or there are no workers left, does the render fail.  A worker that hangs
+// without dying hangs the render, since there is no timeout.
+//
+// Workers are started with fork() and exec, so this only works on POSIX
+// systems; elsewhere start() fails.
+
+#ifndef RENDER_FARM_H
+#define RENDER_FARM_H
+
+#include <string>
+#include <vector>
+
+#include "RenderSettings.h"
+
+class RenderFarm
+{
+public:
+	RenderFarm();
+	// Stops the workers.
+	~RenderFarm();
+
+	// Start numWorkers workers, each running "program -D args...", where
+	// program is looked up like execvp() does.  False (see getError()) if
+	// none of them could be started.
+	bool start(const char* program, const std::vector<std::string>& args, int numWorkers);
+	// Close the workers' sockets, which makes them exit, and wait for them.
+	void stop();
+
+	// Workers still running
+	int size() const;
+
+	// Render the scene in the file scene at width x height with settings
+	// into buf, which holds width * height RGB pixels, bottom row first
+	// like RayTracer::getBuffer().  The path is handed to the workers as
+	// it is, so it must not have spaces in it.  False (see getError()) if
+	// the frame couldn't be finished; buf may then be partly written.
+	bool render(const std::string& scene, int width, int height,
+		const RenderSettings& settings, unsigned char* buf);
+
+	// Bands that had to be rendered again by the last render(), and the
+	// rays the workers traced for it, as they reported them.
+	int retries() const { return numRetries; }
+	unsigned long long raysTraced() const { return numRays; }
+
+	const std::string& getError() const { return error; }
+
+	// Times a band gets tried before the render gives up on it.
+	static const int MAX_ATTEMPTS = 3;
+
+private:
+	RenderFarm(const RenderFarm&);
+	RenderFarm& operator=(const RenderFarm&);
+
+	struct Worker
+	{
+		int pid;
+		int fd;				// our end of the socket, -1 once the worker is gone
+		int band;			// band it is rendering, -1 if idle
+		std::string inbox;	// what it sent that hasn't been used yet
+	};
+
+	// Drop a worker that died or can't be talked to any more.
+	void lose(Worker& worker);
+	// Use up the reply in the worker's inbox, once all of it is there.
+	void receive(Worker& worker, int width, unsigned char* buf);
+	// Put a band that didn't work out back on the queue, or give up on the
+	// render (setting error) if it has been tried too often.
+	void retry(int band, const std::string& why);
+
+	std::vector<Worker> workers;
+	std::string error;
+	int numRetries;
+	unsigned long long numRays;
+
+	// The render in progress
+	int bandHeight, imageHeight;
+	std::vector<int> todo;			// bands waiting for a worker, next one last
+	std::vector<int> attempts;		// by band
+	int bandsLeft;
+};
+
+#endif
@@ -0,0 +1,251 @@
+#include <cassert>
+#include <cmath>
+
+#include "RenderJob.h"
+#include "RayTracer.h"
+#include "scene/raystats.h"
+
+RenderJob::RenderJob()
+	: tracer(NULL), pool(NULL), numPasses(1), regionX(0), regionY(0), regionWidth(0), regionHeight(0),
+	  tileOrder(TileScheduler::HILBERT), mortonPixels(true), progressive(false), onDone(NULL), doneArg(NULL),
+	  active(0), stop(false), numTilesDone(0), raysAtStart(0), rayLimit(0), raysCounted(0),
+	  startTime(clock::now()), endTime(0)
+{
+}
+
+RenderJob::~RenderJob() {
+	cancel();
+	wait(WorkerPool::NO_TIMEOUT);
+}
+
+// The share of the pixels a pass traces: one in step x step, less, below
+// COARSEST, the quarter of those the pass before already did.  The passes
+// down to single pixels add up to the whole frame once.
+static double passWeight(int step) {
+	if (step <= 0)
+		return 1.0;
+	return (step == RenderJob::COARSEST ? 1.0 : 3.0 / 4.0) / (step * step);
+}
+
+void RenderJob::startRegion(RayTracer* rt, WorkerPool& workers, int x0, int y0, int x1, int y1,
+	doneFunc func, void* arg)
+{
+	wait(WorkerPool::NO_TIMEOUT);
+
+	numPasses = 0;
+	if (progressive) {
+		double weights = 0;
+		for (int step = COARSEST; step >= 1; step /= 2) {
+			passStep[numPasses++] = step;
+			weights += passWeight(step);
+		}
+		assert(fabs(weights - 1.0) < 1e-9);
+	}
+	if (!progressive || rt->getSettings().antialias)
+		passStep[numPasses++] = 0;
+	launch(rt, workers, x0, y0, x1, y1, func, arg);
+}
+
+void RenderJob::startRefinement(RayTracer* rt, WorkerPool& workers, int x0, int y0, int x1, int y1,
+	const Refinement& r, doneFunc func, void* arg)
+{
+	wait(WorkerPool::NO_TIMEOUT);
+
+	refinement = r;
+	numPasses = 1;
+	passStep[0] = REFINE;
+	launch(rt, workers, x0, y0, x1, y1, func, arg);
+}
+
+void RenderJob::launch(RayTracer* rt, WorkerPool& workers, int x0, int y0, int x1, int y1,
+	doneFunc func, void* arg)
+{
+	// start() would give an empty pool a worker anyway, but the tiles and
+	// the count of workers still inside the job need to know about it
+	if (workers.size() == 0)
+		workers.resize(1);
+
+	tracer = rt;
+	pool = &workers;
+	regionX = x0;
+	regionY = y0;
+	regionWidth = x1 > x0 ? x1 - x0 : 0;
+	regionHeight = y1 > y0 ? y1 - y0 : 0;
+	onDone = func;
+	doneArg = arg;
+
+	for (int p = 0; p < numPasses; p++)
+		tiles[p].reset(regionWidth, regionHeight, THREAD_CHUNKSIZE, pool->size(), tileOrder);
+	stop.store(false);
+	numTilesDone.store(0);
+	raysAtStart = RayStats::total().total();
+	raysCounted.store(0);
+	startTime = clock::now();
+	endTime.store(0);
+	active.store(pool->size());
+
+	pool->start(workerStart, this);
+}
+
+void RenderJob::cancel() {
+	stop.store(true);
+	for (int p = 0; p < MAX_PASSES; p++)
+		tiles[p].cancel();
+}
+
+bool RenderJob::wait(unsigned int millis) {
+	return pool == NULL || pool->wait(millis);
+}
+
+unsigned long long RenderJob::raysTraced() const {
+	return RayStats::total().total() - raysAtStart;
+}
+
+double RenderJob::elapsed() const {
+	clock::rep end = endTime.load();
+	clock::duration d = end ? clock::duration(end) : clock::now() - startTime;
+	return std::chrono::duration<double>(d).count();
+}
+
+double RenderJob::progress() const {
+	double done = 0, total = 0;
+	for (int p = 0; p < numPasses; p++) {
+		done += passWeight(passStep[p]) * tiles[p].progress();
+		total += passWeight(passStep[p]);
+	}
+	return done / total;
+}
+
+int RenderJob::passesDone() const {
+	int n = 0;
+	while (n < numPasses && tiles[n].pixelsDone() == pixels())
+		n++;
+	return n;
+}
+
+double RenderJob::remaining() const {
+	double done = progress();
+	if (endTime.load())
+		return 0.0;
+	if (done <= 0.0)
+		return -1.0;
+	return elapsed() * (1.0 - done) / done;
+}
+
+void RenderJob::workerStart(int worker, void* arg) {
+	RenderJob* job = (RenderJob*)arg;
+	job->render(worker);
+	if (job->active.fetch_sub(1) == 1)
+		job->finish();
+}
+
+// Every other bit of m, from bit 0: the x (or, shifted by one, the y)
+// of the m-th cell along a Morton curve.
+static inline int mortonCoord(int m) {
+	m &= 0x5555;
+	m = (m | (m >> 1)) & 0x3333;
+	m = (m | (m >> 2)) & 0x0f0f;
+	m = (m | (m >> 4)) & 0x00ff;
+	return m;
+}
+
+// Pixel (x,y) of the region, if the pass with the given step traces it:
+// in a step > 1 pass the pixels on the corners of step x step blocks,
+// painted over their blocks, leaving out the ones earlier passes did; in
+// a refinement, more samples if it needs them.
+void RenderJob::tracePixel(int x, int y, int step) {
+	if (step == 0) {
+		tracer->renderPixel(regionX + x, regionY + y);
+		return;
+	}
+	if (step == REFINE) {
+		x += regionX;
+		y += regionY;
+		if (tracer->pixelSamples(x, y) < refinement.maxSamples && tracer->pixelError(x, y) > refinement.minError)
+			tracer->samplePixel(x, y, refinement.samples);
+		return;
+	}
+	if ((x | y) & (step - 1))
+		return;
+	if (step < COARSEST && !((x | y) & (2 * step - 1)))
+		return;
+	if (step == 1)
+		tracer->tracePixel(regionX + x, regionY + y);
+	else
+		tracer->tracePixelBlock(regionX + x, regionY + y,
+			x + step < regionWidth ? step : regionWidth - x,
+			y + step < regionHeight ? step : regionHeight - y);
+}
+
+bool RenderJob::countRays(unsigned long long& counted) {
+	unsigned long long now = RayStats::local().rayCount();
+	if (now == counted)
+		return true;
+	unsigned long long total = raysCounted.fetch_add(now - counted) + (now - counted);
+	counted = now;
+	if (total < rayLimit)
+		return true;
+	cancel();
+	return false;
+}
+
+bool RenderJob::traceBand(const Tile& tile, int y0, int y1, int step, unsigned long long& counted) {
+	bool limited = rayLimit > 0;
+	if (!mortonPixels) {
+		for (int y = y0; y < y1; y++) {
+			for (int x = tile.x0; x < tile.x1; x++) {
+				tracePixel(x, y, step);
+				if (limited && !countRays(counted))
+					return false;
+			}
+		}
+		return true;
+	}
+
+	for (int bx = tile.x0; bx < tile.x1; bx += BAND) {
+		for (int m = 0; m < BAND * BAND; m++) {
+			int x = bx + mortonCoord(m), y = y0 + mortonCoord(m >> 1);
+			if (x < tile.x1 && y < y1) {
+				tracePixel(x, y, step);
+				if (limited && !countRays(counted))
+					return false;
+			}
+		}
+	}
+	return true;
+}
+
+void RenderJob::render(int worker) {
+	// take() only runs out once every tile of the pass is done, so nobody
+	// starts on a pass before the one under it is finished.
+	unsigned long long counted = RayStats::local().rayCount();
+	for (int p = 0; p < numPasses; p++) {
+		TileScheduler& passTiles = tiles[p];
+		Tile tile;
+		while (!stop.load(std::memory_order_relaxed) && passTiles.take(worker, tile)) {
+			bool whole = true;
+			for (int y = tile.y0; y < tile.y1; ) {
+				int y1 = y + BAND < tile.y1 ? y + BAND : tile.y1;
+				if (stop.load(std::memory_order_relaxed) || !traceBand(tile, y, y1, passStep[p], counted)) {
+					// only count the rows that got done
+					tile.y1 = y;
+					whole = false;
+					break;
+				}
+				y = y1;
+				passTiles.split(worker, tile, y);
+			}
+			passTiles.done(tile);
+			if (whole)
+				numTilesDone.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+}
+
+void RenderJob::finish() {
+	// 0 means still going, so never store that
+	clock::rep end = (clock::now() - startTime).count();
+	endTime.store(end > 0 ? end : 1);
+	if (onDone)
+		onDone(this, doneArg);
+}
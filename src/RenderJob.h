@@ -0,0 +1,167 @@
+// RenderJob.h
+// One frame being rendered on a WorkerPool, which whoever started it can
+// watch and stop.  Workers bump the progress counters as they finish
+// pieces of the image, so they can be read from any thread at any time
+// (to draw a progress bar or an ETA), and they check for cancellation
+// before every tile and between bands of rows, so a stale render stops
+// within a few rows' worth of work.
+//
+// A progressive job renders the frame in passes (see setProgressive()),
+// each handing out tiles of the whole region, and the workers move on to
+// the next pass together once the last tile of the current one is done.
+
+#ifndef RENDER_JOB_H
+#define RENDER_JOB_H
+
+#include <atomic>
+#include <chrono>
+
+#include "threads/WorkerPool.h"
+#include "threads/TileScheduler.h"
+
+class RayTracer;
+
+class RenderJob
+{
+public:
+	// Called once the job is over, whether it finished or was cancelled,
+	// on whichever worker thread finished last.
+	typedef void(*doneFunc)(RenderJob* job, void* arg);
+
+	RenderJob();
+	// Cancels the job if it is still running and waits for it.
+	~RenderJob();
+
+	// Start rendering every pixel of a width x height frame with tracer,
+	// which must already have been through traceSetup() (and renders with
+	// the settings it was given there), on the workers of pool, and return
+	// straight away.  Waits for any earlier job first.
+	void start(RayTracer* tracer, WorkerPool& pool, int width, int height,
+		doneFunc onDone = NULL, void* arg = NULL)
+		{ startRegion(tracer, pool, 0, 0, width, height, onDone, arg); }
+	// The same for just the pixels [x0,x1) x [y0,y1) of the frame.
+	void startRegion(RayTracer* tracer, WorkerPool& pool, int x0, int y0, int x1, int y1,
+		doneFunc onDone = NULL, void* arg = NULL);
+
+	// What a refinement job does to each pixel: trace samples more samples
+	// for it (see RayTracer::samplePixel()) if it has fewer than maxSamples
+	// and RayTracer::pixelError() is above minError.
+	struct Refinement
+	{
+		double minError;
+		int samples;
+		int maxSamples;
+	};
+	// Start refining the pixels [x0,x1) x [y0,y1) of the frame tracer
+	// has set up, adding to the samples they already have.
+	void startRefinement(RayTracer* tracer, WorkerPool& pool, int x0, int y0, int x1, int y1,
+		const Refinement& refinement, doneFunc onDone = NULL, void* arg = NULL);
+
+	// How the frame is walked, from the next start() on: the order tiles
+	// are handed out in, and whether the pixels in a tile are visited
+	// along a Morton (Z order) curve instead of a row at a time.
+	void setTileOrder(TileScheduler::Order order) { tileOrder = order; }
+	void setMortonPixels(bool morton) { mortonPixels = morton; }
+	TileScheduler::Order getTileOrder() const { return tileOrder; }
+	bool getMortonPixels() const { return mortonPixels; }
+
+	// Whether the next start() renders progressively: a pixel in every
+	// COARSEST x COARSEST block first, painted over the whole block, then
+	// the same with blocks half the size and so on down to single pixels,
+	// and then, if the tracer antialiases, every pixel again antialiased.
+	// The frame is whole (if blocky) from the end of the first pass on, so
+	// it can be shown, or the job stopped, at any point after that.
+	void setProgressive(bool on) { progressive = on; }
+	bool getProgressive() const { return progressive; }
+	static const int COARSEST = 8;
+
+	// Ask the workers to stop; they drop what they are doing at the end of
+	// the current band of rows.  Safe to call from any thread, and more than once.
+	void cancel();
+
+	// Have the job cancel itself once its workers have traced this many
+	// rays, from the next start on; 0 for no limit.  The workers count
+	// after every pixel, so the limit is overrun by at most about a pixel's
+	// rays per thread.
+	void setRayLimit(unsigned long long rays) { rayLimit = rays; }
+	unsigned long long getRayLimit() const { return rayLimit; }
+
+	// Wait up to millis for the job to be over; true once it is (or if no
+	// job was ever started).
+	bool wait(unsigned int millis);
+
+	bool running() const { return active.load() > 0; }
+	bool cancelled() const { return stop.load(); }
+
+	// Progress so far.  Pixels count towards pixelsDone() once they are
+	// final, in the last pass; progress() counts the earlier passes as well,
+	// weighted by how many pixels they trace.
+	long	pixelsDone() const { return tiles[numPasses - 1].pixelsDone(); }
+	long	pixels() const { return (long)regionWidth * regionHeight; }
+	int		tilesDone() const { return numTilesDone.load(std::memory_order_relaxed); }
+	double	progress() const;
+	// Passes the job makes over the frame (1 unless progressive), and how
+	// many of them are finished.
+	int		passes() const { return numPasses; }
+	int		passesDone() const;
+	// Rays traced since the job started, by every thread.
+	unsigned long long raysTraced() const;
+
+	// Seconds since the job started, up to when it was over.
+	double elapsed() const;
+	// Estimated seconds until the job is done, from how fast it has gone
+	// so far; negative while there is nothing to go on yet.
+	double remaining() const;
+
+private:
+	RenderJob(const RenderJob&);
+	RenderJob& operator=(const RenderJob&);
+
+	void launch(RayTracer* tracer, WorkerPool& pool, int x0, int y0, int x1, int y1,
+		doneFunc onDone, void* arg);
+	static void workerStart(int worker, void* arg);
+	void render(int worker);
+	// False if the band was left unfinished because the ray limit ran out.
+	bool traceBand(const Tile& tile, int y0, int y1, int step, unsigned long long& counted);
+	void tracePixel(int x, int y, int step);
+	// Add the rays this thread traced since counted to the job's, and
+	// cancel the job if that reaches the limit; false if it does.
+	bool countRays(unsigned long long& counted);
+	void finish();
+
+	typedef std::chrono::steady_clock clock;
+
+	// Rows in a band; with Morton order each band is a row of square
+	// blocks this size.  A power of 2.
+	static const int BAND = 8;
+
+	// Passes: coarsest to single pixels, and the antialiased one
+	static const int MAX_PASSES = 5;
+
+	RayTracer* tracer;
+	WorkerPool* pool;
+	TileScheduler tiles[MAX_PASSES];
+	int passStep[MAX_PASSES];			// block size traced, 0 for the finished pixels,
+										// or REFINE
+	int numPasses;
+	static const int REFINE = -1;
+	Refinement refinement;
+	int regionX, regionY;				// tiles are relative to this corner
+	int regionWidth, regionHeight;
+	TileScheduler::Order tileOrder;
+	bool mortonPixels;
+	bool progressive;
+	doneFunc onDone;
+	void* doneArg;
+
+	std::atomic<int> active;			// workers still inside the job
+	std::atomic<bool> stop;
+	std::atomic<int> numTilesDone;		// pieces, counting split-off parts
+	unsigned long long raysAtStart;
+	unsigned long long rayLimit;
+	std::atomic<unsigned long long> raysCounted;	// by the workers, for the limit
+	clock::time_point startTime;
+	std::atomic<clock::rep> endTime;	// since startTime, or 0 while not over
+};
+
+#endif
@@ -0,0 +1,311 @@
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <sstream>
+#include <vector>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "RenderServer.h"
+#include "RayTracer.h"
+#include "scene/camera.h"
+#include "fileio/imageio.h"
+
+// Argument parsers; false unless all of s is used up.
+static bool parseInt(const std::string& s, int& v) {
+	char* end;
+	long l = strtol(s.c_str(), &end, 10);
+	if (s.empty() || *end)
+		return false;
+	v = (int)l;
+	return true;
+}
+
+static bool parseDouble(const std::string& s, double& v) {
+	char* end;
+	v = strtod(s.c_str(), &end);
+	return !s.empty() && !*end;
+}
+
+static bool parseVec(const std::string& s, Vec3d& v) {
+	double x, y, z;
+	char extra;
+	if (sscanf(s.c_str(), "%lf,%lf,%lf%c", &x, &y, &z, &extra) != 3)
+		return false;
+	v = Vec3d(x, y, z);
+	return true;
+}
+
+static bool parseToneMap(const std::string& s, RenderSettings::ToneMap& v) {
+	for (int k = 0; k < RenderSettings::NUM_TONE_MAPS; k++) {
+		if (s == RenderSettings::toneMapName((RenderSettings::ToneMap)k)) {
+			v = (RenderSettings::ToneMap)k;
+			return true;
+		}
+	}
+	return false;
+}
+
+// The keys a render request may have.
+static const char* renderKeys[] = {
+	"scene", "out", "width", "height", "depth", "cutoff", "aa", "aa_depth", "aa_contrast", "accel", "tonemap", "exposure", "region",
+	"position", "viewdir", "updir", "look_at", "fov", "aspectratio", NULL
+};
+
+RenderServer::RenderServer(WorkerPool& w, RenderJob& j, const HBVBuildOptions& options,
+	const RenderSettings& settings, int width, int max)
+	: workers(w), job(j), buildOptions(options), defaults(settings), defaultWidth(width),
+	  maxScenes(max < 1 ? 1 : max), requests(0)
+{
+}
+
+RenderServer::~RenderServer() {
+	job.cancel();
+	job.wait(WorkerPool::NO_TIMEOUT);
+	for (std::map<std::string, CachedScene>::iterator i = scenes.begin(); i != scenes.end(); ++i)
+		delete i->second.tracer;
+}
+
+void RenderServer::serve(std::istream& in, std::ostream& out) {
+	std::string line;
+	while (std::getline(in, line)) {
+		if (!handle(line, out))
+			break;
+	}
+}
+
+bool RenderServer::handle(const std::string& request, std::ostream& out) {
+	std::istringstream words(request);
+	std::string command, word;
+	if (!(words >> command) || command[0] == '#')
+		return true;
+
+	Args args;
+	while (words >> word) {
+		size_t eq = word.find('=');
+		if (eq == std::string::npos || eq == 0) {
+			out << "error expected key=value, not '" << word << "'" << std::endl;
+			return true;
+		}
+		args[word.substr(0, eq)] = word.substr(eq + 1);
+	}
+
+	requests++;
+	if (command == "quit") {
+		out << "ok" << std::endl;
+		return false;
+	} else if (command == "forget") {
+		Args::const_iterator scene = args.find("scene");
+		if (scene == args.end())
+			out << "error forget needs scene=" << std::endl;
+		else {
+			forget(scene->second);
+			out << "ok" << std::endl;
+		}
+	} else if (command == "render") {
+		std::string error = render(args, out);
+		if (!error.empty())
+			out << "error " << error << std::endl;
+	} else {
+		out << "error unknown command '" << command << "'" << std::endl;
+	}
+	return true;
+}
+
+// When a file last changed, in nanoseconds, as finely as the system keeps it
+static long long modifiedNanos(const struct stat& info) {
+#if defined(WIN32)
+	return (long long)info.st_mtime * 1000000000LL;
+#elif defined(__APPLE__)
+	return (long long)info.st_mtimespec.tv_sec * 1000000000LL + info.st_mtimespec.tv_nsec;
+#else
+	return (long long)info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+#endif
+}
+
+RayTracer* RenderServer::getScene(const std::string& path, bool& cached, double& loadTime, std::string& error) {
+	cached = false;
+	loadTime = 0;
+
+	struct stat info;
+	if (stat(path.c_str(), &info) != 0) {
+		error = "can't read scene file " + path;
+		return NULL;
+	}
+
+	std::map<std::string, CachedScene>::iterator i = scenes.find(path);
+	if (i != scenes.end()) {
+		// A change within the same second as the last one shows up in the
+		// nanoseconds, or failing those (on coarse filesystems) in the size
+		if (i->second.mtime == modifiedNanos(info) && i->second.size == (long long)info.st_size) {
+			cached = true;
+			i->second.lastUsed = requests;
+			return i->second.tracer;
+		}
+		forget(path);
+	}
+
+	if ((int)scenes.size() >= maxScenes) {
+		std::map<std::string, CachedScene>::iterator oldest = scenes.begin();
+		for (i = scenes.begin(); i != scenes.end(); ++i) {
+			if (i->second.lastUsed < oldest->second.lastUsed)
+				oldest = i;
+		}
+		forget(oldest->first);
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	RayTracer* tracer = new RayTracer();
+	if (!tracer->loadScene(path.c_str(), buildOptions)) {
+		error = tracer->getError();
+		delete tracer;
+		return NULL;
+	}
+	loadTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	CachedScene& entry = scenes[path];
+	entry.tracer = tracer;
+	entry.mtime = modifiedNanos(info);
+	entry.size = info.st_size;
+	entry.lastUsed = requests;
+	return tracer;
+}
+
+void RenderServer::forget(const std::string& path) {
+	std::map<std::string, CachedScene>::iterator i = scenes.find(path);
+	if (i == scenes.end())
+		return;
+	delete i->second.tracer;
+	scenes.erase(i);
+}
+
+std::string RenderServer::render(const Args& args, std::ostream& out) {
+	for (Args::const_iterator a = args.begin(); a != args.end(); ++a) {
+		int k = 0;
+		while (renderKeys[k] && a->first != renderKeys[k])
+			k++;
+		if (!renderKeys[k])
+			return "unknown argument '" + a->first + "'";
+	}
+
+	Args::const_iterator scene = args.find("scene"), outFile = args.find("out");
+	if (scene == args.end() || outFile == args.end())
+		return "render needs scene= and out=";
+	bool raw = outFile->second == "-";
+	std::string type = outFile->second.size() > 4 ? outFile->second.substr(outFile->second.size() - 4) : "";
+	for (size_t c = 0; c < type.size(); c++)
+		type[c] = (char)tolower(type[c]);
+	if (!raw && type != ".png" && type != ".jpg")
+		return "out must be a .png or .jpg file, or -";
+
+	// Everything gets checked before anything gets loaded or changed.
+	RenderSettings settings = defaults;
+	int width = defaultWidth, height = 0, aa = settings.antialias ? 1 : 0, accel = settings.accelerate ? 1 : 0;
+	int region[4] = { 0, 0, 0, 0 };
+	double fov = 0, aspect = 0;
+	Vec3d position, viewDir, upDir, lookAt;
+	Args::const_iterator a;
+	if (((a = args.find("width")) != args.end() && (!parseInt(a->second, width) || width < 1))
+		|| ((a = args.find("height")) != args.end() && (!parseInt(a->second, height) || height < 1))
+		|| ((a = args.find("depth")) != args.end() && (!parseInt(a->second, settings.depth) || settings.depth < 0))
+		|| ((a = args.find("cutoff")) != args.end() && (!parseDouble(a->second, settings.cutoff) || settings.cutoff < 0))
+		|| ((a = args.find("aa")) != args.end() && (!parseInt(a->second, aa) || (aa != 0 && aa != 1)))
+		|| ((a = args.find("aa_depth")) != args.end() && (!parseInt(a->second, settings.aaDepth) || settings.aaDepth < 0))
+		|| ((a = args.find("aa_contrast")) != args.end() && (!parseDouble(a->second, settings.aaContrast) || settings.aaContrast < 0))
+		|| ((a = args.find("accel")) != args.end() && (!parseInt(a->second, accel) || (accel != 0 && accel != 1)))
+		|| ((a = args.find("tonemap")) != args.end() && !parseToneMap(a->second, settings.toneMap))
+		|| ((a = args.find("exposure")) != args.end() && (!parseDouble(a->second, settings.exposure) || settings.exposure < 0))
+		|| ((a = args.find("fov")) != args.end() && (!parseDouble(a->second, fov) || fov <= 0 || fov >= 180))
+		|| ((a = args.find("aspectratio")) != args.end() && (!parseDouble(a->second, aspect) || aspect <= 0))
+		|| ((a = args.find("position")) != args.end() && !parseVec(a->second, position))
+		|| ((a = args.find("viewdir")) != args.end() && !parseVec(a->second, viewDir))
+		|| ((a = args.find("updir")) != args.end() && !parseVec(a->second, upDir))
+		|| ((a = args.find("look_at")) != args.end() && !parseVec(a->second, lookAt)))
+		return "bad value for " + a->first;
+	settings.antialias = aa != 0;
+	settings.accelerate = accel != 0;
+	bool hasRegion = (a = args.find("region")) != args.end();
+	if (hasRegion) {
+		char extra;
+		if (sscanf(a->second.c_str(), "%d,%d,%d,%d%c", &region[0], &region[1], &region[2], &region[3], &extra) != 4)
+			return "bad value for region";
+	}
+
+	bool cached;
+	double loadTime;
+	std::string error;
+	RayTracer* tracer = getScene(scene->second, cached, loadTime, error);
+	if (!tracer)
+		return error;
+
+	// Point the camera for this request only
+	Camera& camera = tracer->getCamera();
+	Camera saved = camera;
+	if (args.count("position"))
+		camera.setEye(position);
+	if (args.count("fov"))
+		camera.setFOV(fov);
+	if (args.count("aspectratio"))
+		camera.setAspectRatio(aspect);
+	if (args.count("look_at")) {
+		if (!camera.setLookSimple(lookAt, camera.getEye())) {
+			camera = saved;
+			return "can't look at the position of the camera";
+		}
+		if (args.count("updir"))
+			camera.setLook(camera.getLook(), upDir);
+	} else if (args.count("viewdir")) {
+		camera.setLook(viewDir, args.count("updir") ? upDir : camera.getV());
+	} else if (args.count("updir")) {
+		camera.setLook(camera.getLook(), upDir);
+	}
+
+	if (height == 0)
+		height = (int)(width / tracer->aspectRatio() + 0.5);
+	if (height < 1)
+		height = 1;
+	if (!hasRegion) {
+		region[2] = width;
+		region[3] = height;
+	} else if (region[0] < 0 || region[1] < 0 || region[2] > width || region[3] > height
+		|| region[0] >= region[2] || region[1] >= region[3]) {
+		camera = saved;
+		return "region must be inside the image and not empty";
+	}
+
+	tracer->traceSetup(width, height, settings);
+	job.startRegion(tracer, workers, region[0], region[1], region[2], region[3]);
+	job.wait(WorkerPool::NO_TIMEOUT);
+	camera = saved;
+
+	// Copy out just the region, bottom row first like the tracer's buffer
+	int w = region[2] - region[0], h = region[3] - region[1];
+	unsigned char* buf;
+	int bufWidth, bufHeight;
+	tracer->getBuffer(buf, bufWidth, bufHeight);
+	std::vector<unsigned char> image((size_t)w * h * 3);
+	for (int y = 0; y < h; y++)
+		memcpy(&image[(size_t)y * w * 3], buf + ((size_t)(region[1] + y) * bufWidth + region[0]) * 3, (size_t)w * 3);
+
+	if (!raw) {
+		try {
+			save(outFile->second.c_str(), &image[0], w, h, type.c_str(), 95);
+		} catch (...) {
+			return "can't write " + outFile->second;
+		}
+	}
+
+	out << "ok width=" << w << " height=" << h << " cached=" << (cached ? 1 : 0)
+		<< " load=" << loadTime << " render=" << job.elapsed()
+		<< " rays=" << job.raysTraced();
+	if (raw) {
+		out << " bytes=" << image.size() << "\n";
+		out.write((const char*)&image[0], image.size());
+		out.flush();
+	} else {
+		out << std::endl;
+	}
+	return "";
+}
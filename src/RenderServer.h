@@ -0,0 +1,94 @@
+// RenderServer.h
+// A long running renderer that answers requests read from a stream (stdin
+// for "ray -D"), one per line.  Scenes stay loaded between requests, keyed
+// by path, modification time and size, so rendering the same scene again
+// with a different camera or size skips parsing it and building its bvh.
+//
+// A request is a command followed by key=value arguments:
+//
+//   render scene=<file.ray> out=<image.png|.jpg> [width=<#>] [height=<#>]
+//          [depth=<#>] [cutoff=<#>] [aa=0|1] [aa_depth=<#>] [aa_contrast=<#>]
+//          [accel=0|1] [tonemap=clamp|reinhard] [exposure=<#>]
+//          [region=x0,y0,x1,y1]
+//          [position=x,y,z] [viewdir=x,y,z] [updir=x,y,z] [look_at=x,y,z]
+//          [fov=<degrees>] [aspectratio=<#>]
+//   forget scene=<file.ray>		drop a scene from the cache
+//   quit
+//
+// and gets one line back: "ok" followed by key=value results, or "error"
+// followed by a message.  The camera arguments work as they do in a .ray
+// file and only last for their request.  A region is in pixels,
+// [x0,x1) x [y0,y1), counted from the bottom left like
+// RayTracer::tracePixel(), and out then only gets the region.  Blank lines
+// and lines starting with # are ignored.
+//
+// With out=- nothing is saved; the "ok" line ends in bytes=<#> instead and
+// is followed by that many bytes of raw RGB, the rows of the image (or
+// region) from the bottom up.  That is how RenderFarm gets its tiles back.
+//
+// Files a scene reads besides the .ray file itself (textures, meshes) are
+// not checked for changes; "forget" the scene after changing them.
+
+#ifndef RENDER_SERVER_H
+#define RENDER_SERVER_H
+
+#include <iostream>
+#include <map>
+#include <string>
+
+#include "RenderSettings.h"
+#include "RenderJob.h"
+#include "scene/hbv.h"
+
+class RayTracer;
+
+class RenderServer
+{
+public:
+	// Render with job on workers, building bvhs with options.  Requests
+	// that don't say otherwise get rendered with defaults at defaultWidth.
+	// At most maxScenes scenes are kept loaded; the least recently used
+	// one goes first.
+	RenderServer(WorkerPool& workers, RenderJob& job, const HBVBuildOptions& options,
+		const RenderSettings& defaults, int defaultWidth, int maxScenes = 8);
+	~RenderServer();
+
+	// Answer requests from in on out until in runs out or says quit.
+	void serve(std::istream& in, std::ostream& out);
+
+	// Answer one request; false if it was quit.
+	bool handle(const std::string& request, std::ostream& out);
+
+private:
+	RenderServer(const RenderServer&);
+	RenderServer& operator=(const RenderServer&);
+
+	typedef std::map<std::string, std::string> Args;
+
+	struct CachedScene
+	{
+		RayTracer* tracer;
+		long long mtime;		// in nanoseconds
+		long long size;
+		unsigned long lastUsed;
+	};
+
+	// The loaded scene for path, loading it if it isn't cached or the file
+	// changed since; NULL (with error set) if it can't be loaded.
+	RayTracer* getScene(const std::string& path, bool& cached, double& loadTime, std::string& error);
+	void forget(const std::string& path);
+
+	// Render a request; an empty string if it went well, else what went wrong.
+	std::string render(const Args& args, std::ostream& out);
+
+	WorkerPool& workers;
+	RenderJob& job;
+	HBVBuildOptions buildOptions;
+	RenderSettings defaults;
+	int defaultWidth;
+	int maxScenes;
+	std::map<std::string, CachedScene> scenes;
+	unsigned long requests;
+};
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef __RENDER_SETTINGS_H__
+#define __RENDER_SETTINGS_H__
+
+// What a frame is to be rendered with.  The UI fills one in and hands it
+// to RayTracer::traceSetup(), and the tracer keeps its own copy for the
+// whole frame, so tracing never has to go back to the UI for anything
+// and nothing can change under the render threads halfway through.
+
+struct RenderSettings
+{
+	RenderSettings()
+		: depth( 0 ), cutoff( 0.004 ), antialias( false ), aaDepth( 2 ), aaContrast( 0.05 ),
+		  accelerate( true ), toneMap( CLAMP ), exposure( 1.0 )
+	{ }
+
+	// How colours, which the tracer keeps as floats with no upper limit,
+	// become 8 bit pixels: multiplied by exposure, then either clipped to
+	// 0-1 (CLAMP) or squeezed into it with c / (1 + c) (REINHARD), which
+	// keeps some detail in highlights that clipping would flatten.
+	enum ToneMap { CLAMP, REINHARD, NUM_TONE_MAPS };
+	static const char* toneMapName( ToneMap op )
+	{
+		static const char* names[NUM_TONE_MAPS] = { "clamp", "reinhard" };
+		return op >= 0 && op < NUM_TONE_MAPS ? names[op] : "?";
+	}
+
+	int		depth;			// max recursion depth for reflected and refracted rays
+	double	cutoff;			// reflected and refracted rays that would count for less
+							// than this in the pixel (in every channel) aren't traced;
+							// the default is about one step of an 8 bit channel
+	bool	antialias;		// supersample each pixel instead of one ray through its corner
+
+	// Antialiasing is adaptive: a pixel gets a ray through each of its
+	// corners, shared with its neighbours, and is split in four again and
+	// again for as long as the colours at the corners of a piece differ by
+	// more than aaContrast (in any channel, on a 0-1 scale), up to aaDepth
+	// times.  An aaDepth of 0 samples every pixel on a fixed 3x3 grid instead.
+	int		aaDepth;
+	double	aaContrast;
+
+	bool	accelerate;		// find hits through the scene's bvh; if false, every
+							// ray is tested against every object (see Scene::setAccelerated)
+
+	ToneMap	toneMap;
+	double	exposure;
+};
+
+#endif // __RENDER_SETTINGS_H__
@@ -65,7 +65,9 @@ protected:
 	double gamma, gamma_squared;
 
 protected:
+#ifndef COMMAND_LINE_ONLY
 	void glDrawLocal(int quality, bool actualMaterials, bool actualTextures) const;
+#endif
 
 };
 
@@ -31,7 +31,9 @@ protected:
 	bool capped;
 
 protected:
+#ifndef COMMAND_LINE_ONLY
 	void glDrawLocal(int quality, bool actualMaterials, bool actualTextures) const;
+#endif
 
 };
 
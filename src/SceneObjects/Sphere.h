@@ -24,6 +24,8 @@ public:
     }
 
 protected:
+#ifndef COMMAND_LINE_ONLY
 	void glDrawLocal(int quality, bool actualMaterials, bool actualTextures) const;
+#endif
 };
 #endif // __SPHERE_H__
@@ -24,7 +24,9 @@ public:
     }
 
 protected:
+#ifndef COMMAND_LINE_ONLY
 	void glDrawLocal(int quality, bool actualMaterials, bool actualTextures) const;
+#endif
 
 };
 
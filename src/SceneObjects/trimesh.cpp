@@ -10,11 +10,26 @@ Trimesh::~Trimesh()
 		delete *i;
 }
 
-bool Trimesh::hasPerVertexNormals()
+bool Trimesh::hasPerVertexNormals() const
 {
 	return !(this->normals.empty());
 }
 
+bool Trimesh::hasPerVertexMaterials() const
+{
+	return !(this->materials.empty());
+}
+
+bool Trimesh::hasTransmissiveMaterial() const
+{
+	if( material->transmissive() )
+		return true;
+	for( Materials::const_iterator i = materials.begin(); i != materials.end(); ++i )
+		if( (*i)->transmissive() )
+			return true;
+	return false;
+}
+
 // must add vertices, normals, and materials IN ORDER
 void Trimesh::addVertex( const Vec3d &v )
 {
@@ -44,13 +59,41 @@ bool Trimesh::addFace( int a, int b, int c )
     if( a >= vcnt || b >= vcnt || c >= vcnt )
         return false;
 
-    TrimeshFace *newFace = new TrimeshFace( scene, new Material(*this->material), this, a, b, c );
-    newFace->setTransform(this->transform);
-    faces.push_back( newFace );
-    scene->add(newFace);
+    faces.push_back( TrimeshFace( a, b, c ) );
     return true;
 }
 
+BoundingBox Trimesh::faceLocalBounds( const TrimeshFace& face ) const
+{
+    BoundingBox localbounds;
+    localbounds.max = maximum( vertices[face[0]], vertices[face[1]]);
+	localbounds.min = minimum( vertices[face[0]], vertices[face[1]]);
+    
+    localbounds.max = maximum( vertices[face[2]], localbounds.max);
+	localbounds.min = minimum( vertices[face[2]], localbounds.min);
+    return localbounds;
+}
+
+BoundingBox Trimesh::primitiveBounds( int k ) const
+{
+    return localToGlobalBounds( faceLocalBounds( faces[k] ) );
+}
+
+BoundingBox Trimesh::ComputeLocalBoundingBox()
+{
+    BoundingBox localbounds;
+    if( vertices.empty() )
+        return localbounds;
+
+    localbounds.max = localbounds.min = vertices[0];
+    for( Vertices::const_iterator vi = vertices.begin(); vi != vertices.end(); ++vi )
+    {
+        localbounds.max = maximum( *vi, localbounds.max );
+        localbounds.min = minimum( *vi, localbounds.min );
+    }
+    return localbounds;
+}
+
 char *
 Trimesh::doubleCheck()
 // Check to make sure that if we have per-vertex materials or normals
@@ -64,65 +107,118 @@ Trimesh::doubleCheck()
     return 0;
 }
 
+// Runs the vertices and normals through the mesh's transform once, here,
+// and leaves the mesh with the scene's (identity) root transform, so that
+// intersecting its faces never has to move rays into local space.
+void Trimesh::bakeTransform()
+{
+    if( transform->getKind() == TransformNode::IDENTITY )
+        return;
+
+    for( Vertices::iterator vi = vertices.begin(); vi != vertices.end(); ++vi )
+        *vi = transform->localToGlobalCoords( *vi );
+    // Not normalized: intersectPrimitiveLocal normalizes after
+    // interpolating, which then gives the same normal as before.
+    const Mat3d &normi = transform->normalTransform();
+    for( Normals::iterator ni = normals.begin(); ni != normals.end(); ++ni )
+        *ni = normi * *ni;
+    // A mirroring transform turns the baked faces inside out, and face
+    // normals come from the winding, so wind them back the right way
+    if( normi.determinant() < 0 )
+        for( Faces::iterator fi = faces.begin(); fi != faces.end(); ++fi )
+            fi->flip();
+
+    transform = &scene->transformRoot;
+}
+
 extern bool debugMode;
 
-// Calculates and returns the normal of the triangle too.
-bool TrimeshFace::intersectLocal( const ray& r, isect& i ) const
+bool Trimesh::intersectLocal( const ray& r, isect& i ) const
+{
+  bool found = false;
+  for( int k = 0; k < (int)faces.size(); ++k ) {
+	isect cur;
+	if( intersectPrimitiveLocal( k, r, cur ) && ( !found || cur.t < i.t ) ) {
+	  i = cur;
+	  found = true;
+	}
+  }
+  return found;
+}
+
+// Intersects face k.  Calculates and returns the normal of the triangle too.
+//
+// This is the Moller-Trumbore test: it solves for t and the barycentric
+// coordinates of the hit in one go from the two edges at a, so there is
+// no plane to build and nothing to normalize unless the ray actually hits.
+bool Trimesh::intersectPrimitiveLocal( int k, const ray& r, isect& i ) const
 {
-  Vec3d &a = parent->vertices[ids[0]];
-  Vec3d &b = parent->vertices[ids[1]];
-  Vec3d &c = parent->vertices[ids[2]];
+  const TrimeshFace &face = faces[k];
+  const Vec3d &a = vertices[face[0]];
+  const Vec3d &b = vertices[face[1]];
+  const Vec3d &c = vertices[face[2]];
 
   const Vec3d bSubA = b - a;
   const Vec3d cSubA = c - a;
 
-  Vec3d abc_cross = bSubA ^ cSubA;
-  
-  Vec3d n = abc_cross;
-  if(n.length() == 0) {
+  const Vec3d &d = r.getDirection();
+  Vec3d p = d ^ cSubA;
+  // zero for rays parallel to the triangle, and for degenerate triangles
+  double det = bSubA * p;
+  if(det == 0) {
 	return false;
   }
-  n.normalize();
-  double plane_d = n * a;
-  
-  double denom = n * r.getDirection();
-  if(denom == 0) {
+  double invDet = 1.0 / det;
+
+  Vec3d s = r.getPosition() - a;
+  double beta = (s * p) * invDet;
+  if(beta < 0 || beta > 1) {
 	return false;
   }
 
-  double num = plane_d - n * r.getPosition();
-  double t = num / denom;
-  if(t < RAY_EPSILON) {
+  Vec3d q = s ^ bSubA;
+  double gamma = (d * q) * invDet;
+  if(gamma < 0 || beta + gamma > 1) {
 	return false;
   }
 
-  Vec3d q = r.at(t);
-  double abCrossAQ = (bSubA ^ (q - a)) * n;
-  double bcCrossBQ = ((c - b) ^ (q - b)) * n;
-  double caCrossCQ = ((a - c) ^ (q - c)) * n;
-  if(abCrossAQ < 0 || bcCrossBQ < 0 || caCrossCQ < 0) {
+  double t = (cSubA * q) * invDet;
+  if(t < RAY_EPSILON) {
 	return false;
   }
 
   // if(debugMode) {
-  // 	std::cout << ids[0] << " " << ids[1] << " " << ids[2] << std::endl;
+  // 	std::cout << face[0] << " " << face[1] << " " << face[2] << std::endl;
   // 	std::cout << a << ", " << b << ", " << c << std::endl;
   // }
   
-  double baryDenom =  abc_cross * n;
-  double alpha = bcCrossBQ / baryDenom;
-  double beta = caCrossCQ / baryDenom;
-  double gamma = abCrossAQ / baryDenom;
+  double alpha = 1.0 - beta - gamma;
   i.obj = this;
   i.t = t;
-  i.setMaterial(*this->material);
-  if(parent->hasPerVertexNormals()) {
-	Vec3d n_q = alpha * parent->normals.at(ids[0]) + 
-	  beta * parent->normals.at(ids[1]) + 
-	  gamma * parent->normals.at(ids[2]);
+  // The mesh's own material is found through obj; only a material
+  // blended from per-vertex materials has to live in the isect.
+  if(hasPerVertexMaterials()) {
+	Material m = alpha * *materials[face[0]];
+	m += beta * *materials[face[1]];
+	m += gamma * *materials[face[2]];
+	i.setMaterial(m);
+  }
+  if(textureuvs.size() == vertices.size()) {
+	const Vec2d &uv0 = textureuvs[face[0]];
+	const Vec2d &uv1 = textureuvs[face[1]];
+	const Vec2d &uv2 = textureuvs[face[2]];
+	i.setUVCoordinates( Vec2d( alpha * uv0[0] + beta * uv1[0] + gamma * uv2[0],
+							   alpha * uv0[1] + beta * uv1[1] + gamma * uv2[1] ) );
+  }
+  if(hasPerVertexNormals()) {
+	Vec3d n_q = alpha * normals.at(face[0]) + 
+	  beta * normals.at(face[1]) + 
+	  gamma * normals.at(face[2]);
 	n_q.normalize();
 	i.setN(n_q);
   } else {
+	Vec3d n = bSubA ^ cSubA;
+	n.normalize();
 	i.setN(n);
   }
   return true;
@@ -141,17 +237,17 @@ Trimesh::generateNormals()
     
     for( Faces::iterator fi = faces.begin(); fi != faces.end(); ++fi )
     {
-        Vec3d a = vertices[(**fi)[0]];
-        Vec3d b = vertices[(**fi)[1]];
-        Vec3d c = vertices[(**fi)[2]];
+        Vec3d a = vertices[(*fi)[0]];
+        Vec3d b = vertices[(*fi)[1]];
+        Vec3d c = vertices[(*fi)[2]];
         
         Vec3d faceNormal = ((b-a) ^ (c-a));
 		faceNormal.normalize();
         
         for( int i = 0; i < 3; ++i )
         {
-            normals[(**fi)[i]] += faceNormal;
-            ++numFaces[(**fi)[i]];
+            normals[(*fi)[i]] += faceNormal;
+            ++numFaces[(*fi)[i]];
         }
     }
 
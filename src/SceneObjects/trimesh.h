@@ -7,15 +7,40 @@
 #include "../scene/ray.h"
 #include "../scene/material.h"
 #include "../scene/scene.h"
-class TrimeshFace;
+
+// A face is just three indices into its trimesh's vertex arrays; the
+// trimesh does all the intersecting and shading for its faces.
+class TrimeshFace
+{
+    int ids[3];
+public:
+    TrimeshFace( int a, int b, int c )
+    {
+        ids[0] = a;
+        ids[1] = b;
+        ids[2] = c;
+    }
+
+    int operator[]( int i ) const
+    {
+        return ids[i];
+    }
+
+    // Wind the face the other way round, which turns its normal around
+    void flip()
+    {
+        int b = ids[1];
+        ids[1] = ids[2];
+        ids[2] = b;
+    }
+};
 
 class Trimesh : public MaterialSceneObject
 {
-    friend class TrimeshFace;
     typedef std::vector<Vec3d> Normals;
     typedef std::vector<Vec3d> Vertices;
 	typedef std::vector<Vec2d> TextureUVs;
-    typedef std::vector<TrimeshFace*> Faces;
+    typedef std::vector<TrimeshFace> Faces;
     typedef std::vector<Material*> Materials;
     Vertices vertices;
     Faces faces;
@@ -32,7 +57,9 @@ public:
         this->transform = transform;
     }
 
-	bool intersectLocal(const ray&r, isect&i) const { return false; } 
+	// Closest hit over every face.  The acceleration structure goes through
+	// intersectPrimitiveLocal() instead, one face at a time.
+	bool intersectLocal(const ray&r, isect&i) const;
 
     ~Trimesh();
     
@@ -48,49 +75,32 @@ public:
     
     void generateNormals();
 
-	bool hasPerVertexNormals();
+	// moves the mesh into world space; call once all the vertices,
+	// normals and faces are in
+	void bakeTransform();
+
+	bool hasPerVertexNormals() const;
+	bool hasPerVertexMaterials() const;
+
+	virtual bool hasTransmissiveMaterial() const;
+
+	// The faces are handed to the acceleration structure individually.
+	virtual bool hasBoundingBoxCapability() const { return true; }
+	virtual int primitiveCount() const { return faces.size(); }
+	virtual BoundingBox primitiveBounds( int k ) const;
+	virtual BoundingBox ComputeLocalBoundingBox();
 
 protected:
+	virtual bool intersectPrimitiveLocal( int k, const ray& r, isect& i ) const;
+	BoundingBox faceLocalBounds( const TrimeshFace& face ) const;
+
+#ifndef COMMAND_LINE_ONLY
 	void glDrawLocal(int quality, bool actualMaterials, bool actualTextures) const;
+#endif
 
 	mutable int displayListWithMaterials;
 	mutable int displayListWithoutMaterials;
 };
 
-class TrimeshFace : public MaterialSceneObject
-{
-    Trimesh *parent;
-    int ids[3];
-public:
-    TrimeshFace( Scene *scene, Material *mat, Trimesh *parent, int a, int b, int c)
-        : MaterialSceneObject( scene, mat )
-    {
-        this->parent = parent;
-        ids[0] = a;
-        ids[1] = b;
-        ids[2] = c;
-    }
-
-    int operator[]( int i ) const
-    {
-        return ids[i];
-    }
-
-    virtual bool intersectLocal( const ray& r, isect& i ) const;
-
-    virtual bool hasBoundingBoxCapability() const { return true; }
-      
-    virtual BoundingBox ComputeLocalBoundingBox()
-    {
-        BoundingBox localbounds;
-        localbounds.max = maximum( parent->vertices[ids[0]], parent->vertices[ids[1]]);
-		localbounds.min = minimum( parent->vertices[ids[0]], parent->vertices[ids[1]]);
-        
-        localbounds.max = maximum( parent->vertices[ids[2]], localbounds.max);
-		localbounds.min = minimum( parent->vertices[ids[2]], localbounds.min);
-        return localbounds;
-    }
- };
-
 
 #endif // TRIMESH_H__
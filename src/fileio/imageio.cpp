@@ -1,5 +1,8 @@
 #define cimg_use_png
 #define cimg_use_jpeg
+#ifdef COMMAND_LINE_ONLY
+#define cimg_display_type 0		// no X11 either
+#endif
 
 #include "CImg.h"
 #include "imageio.h"
@@ -724,6 +724,8 @@ void Parser::parseTrimesh(Scene* scene, TransformNode* transform, const Material
         if( error = tmesh->doubleCheck() )
           throw ParserException( error );
 
+        tmesh->bakeTransform();
+
         scene->add( tmesh );
         return;
       }
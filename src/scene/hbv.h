@@ -1,145 +1,334 @@
 #ifndef __HBV_H__
 #define __HBV_H__
 
-#include "scene.h"
+#include <cfloat>
+#include <cmath>
+#include <cstdlib>
+#include <new>
+#ifdef WIN32
+#include <malloc.h>
+#endif
 
-extern bool debugMode;
+#include "scene.h"
+#include "../threads/ThreadPool.h"
 
-std::ostream &operator<<(std::ostream &str, const BoundingBox &bbox) {
+inline std::ostream &operator<<(std::ostream &str, const BoundingBox &bbox) {
   str << "[Min: " << bbox.min << ", Max: " << bbox.max << "]";
   return str;
 }
 
+// Options controlling how the hierarchy is built.  The midpoint builder
+// splits on the spatial midpoint of a round-robin axis and always builds
+// single-primitive leaves; the SAH builder bins primitive centroids along
+// every axis and picks the split with the lowest surface area heuristic
+// cost, stopping once a leaf is cheaper than any split.
+struct HBVBuildOptions
+{
+  enum Method { MIDPOINT, SAH };
+
+  HBVBuildOptions()
+	: method(SAH), sahBins(16), maxLeafSize(4),
+	  traversalCost(1.0), intersectionCost(1.0),
+	  numThreads(1), minParallelSize(4096) { }
+
+  Method method;
+  int sahBins;				// number of centroid bins per axis (SAH only)
+  int maxLeafSize;			// nodes with more primitives are always split (SAH only)
+  double traversalCost;		// relative cost of visiting an interior node
+  double intersectionCost;	// relative cost of testing one primitive
+  int numThreads;			// threads used to build subtrees in parallel
+  int minParallelSize;		// smaller subtrees are never handed to another thread
+};
+
+// Multiply atten by the transmissive coefficient at every surface of obj
+// (a Geometry, or one primitive of one) that the ray crosses before tMax,
+// going in and coming out alike, so light through a closed solid is dimmed
+// at both of its faces.  False once atten drops to zero.
+template<class Obj>
+inline bool attenuateCrossings(const Obj &obj, const ray &r, double tMax, Vec3d &atten) {
+  // A ray that keeps hitting the same spot can't stall the shadow query
+  const int MAX_CROSSINGS = 64;
+  ray cur(r);
+  double travelled = 0;
+  isect hit;
+  for(int n = 0; n < MAX_CROSSINGS && obj.intersect(cur, hit) && travelled + hit.t < tMax; n++) {
+	atten = prod(atten, hit.getMaterial().kt(hit));
+	if(atten.iszero()) {
+	  return false;
+	}
+	travelled += hit.t;
+	cur = ray(cur.at(hit.t), r.getDirection(), r.type());
+  }
+  return true;
+}
+
 class HBV {
 private:
+  // Node of the pointer tree the builders produce.  It only lives for the
+  // duration of build(), which flattens it into the linear node array that
+  // is actually traversed.  Leaves refer to the range
+  // [firstPrim, firstPrim + primCount) of HBV::primitives.
   class HBV_Node {
   public:
-	HBV_Node(Geometry *g) : bbox(g), left(NULL), right(NULL), isLeaf(true) { }
-	HBV_Node(const BoundingBox &b, HBV_Node *l, HBV_Node *r) : bbox(new BoundingBox(b)), left(l), right(r), isLeaf(false) { }
-	inline const BoundingBox &getBoundingBox() const {
-	  if(isLeaf) {
-		return reinterpret_cast<Geometry*>(bbox)->getBoundingBox();
-	  } else {
-		return *reinterpret_cast<BoundingBox*>(bbox);
-	  }
-	}
-	bool intersect(const ray &r, isect &i) const {
-	  const BoundingBox &b = getBoundingBox();
-	  double tMin, tMax;
-	  if(!b.intersect(r, tMin, tMax)) {
-		if(debugMode && false) {
-		  std::cout<< "does not interset bb, skipping " << b << std::endl;
-		}
-		return false;
-	  }
-	  if(debugMode && false) {
-		std::cout << "SUCCESS! " << b << std::endl;
-	  }
-	  
-	  if(!isLeaf) {
-		isect rightHit, leftHit;
-		bool rightFound = false, leftFound = false;
-		if(left) {
-		  leftFound = left->intersect(r, leftHit);
-		}
-		if(right) {
-		  rightFound = right->intersect(r, rightHit);
-		}
-		if(leftFound && rightFound) {
-		  if(leftHit.t < rightHit.t) {
-			i = leftHit;
-		  } else {
-			i = rightHit;
-		  }
-		  return true;
-		} else if(leftFound) {
-		  i = leftHit;
-		  return true;
-		} else if(rightFound) {
-		  i = rightHit;
-		  return true;
-		}
-		return false;
-	  } else {
-		if(debugMode && false) {
-		  std::cout << "and here we ARE! " << b << " " << std::endl;
-		}
-		Geometry *g = reinterpret_cast<Geometry*>(bbox);
-		bool ret = g->intersect(r, i);
-		if(debugMode && ret && false) {
-		  std::cout << "hit " << b << std::endl;
-		}
-		return ret;
-	  }
-	}
+	HBV_Node(const BoundingBox &b, int first, int count) : bbox(b), left(NULL), right(NULL), firstPrim(first), primCount(count), axis(0) { }
+	HBV_Node(const BoundingBox &b, HBV_Node *l, HBV_Node *r, int a) : bbox(b), left(l), right(r), firstPrim(0), primCount(0), axis(a) { }
 	~HBV_Node() {
 	  delete left;
 	  delete right;
-	  if(!isLeaf) {
-		delete reinterpret_cast<BoundingBox*>(bbox);
-	  }
 	}
-	void *bbox;
+	bool isLeaf() const { return primCount > 0; }
+	BoundingBox bbox;
 	HBV_Node *left, *right;
-	bool isLeaf;
+	int firstPrim, primCount;
+	int axis;
+  };
+
+  // Node of the flattened hierarchy, laid out depth first so that the
+  // first child of an interior node always directly follows it.  Bounds
+  // are stored as floats, rounded outwards, to fit a node in 32 bytes.
+  // bounds[0] is the min corner and bounds[1] the max corner, so that a
+  // ray's sign bits index the near and far planes directly.
+  struct LinearNode {
+	float bounds[2][3];
+	int offset;				// leaf: first primitive; interior: index of the second child
+	unsigned short count;	// number of primitives, 0 for interior nodes
+	unsigned char axis;		// split axis of interior nodes
+	unsigned char pad;
+  };
+  static_assert(sizeof(LinearNode) == 32, "LinearNode must fill exactly half a cache line");
+
+  // The flattened hierarchy, allocated on a 32 byte boundary so that
+  // each node sits in a single cache line.
+  LinearNode *linearNodes;
+  int nodeCount, leafCount, maxDepth;
+  HBVBuildOptions options;
+  double cost;
+
+  // A primitive is either a whole object (index < 0) or one piece of an
+  // object that splits itself up, such as a single triangle of a trimesh.
+  struct PrimRef {
+	const Geometry *obj;
+	int index;
+	inline bool intersect(const ray &r, isect &i) const {
+	  return index < 0 ? obj->intersect(r, i) : obj->intersectPrimitive(index, r, i);
+	}
   };
-  HBV_Node* root;
-  HBV_Node *buildNode(const std::vector<Geometry*> &input, const BoundingBox& bbox, int axis) {
-	if(input.size() == 0) {
+
+  // Primitives in leaf order; filled in by build().
+  std::vector<PrimRef> primitives;
+
+  // Scratch state shared by all build threads.  Each subtree only ever
+  // reorders its own range of buildIndex, so threads never touch the same
+  // elements; the other arrays are read-only while building.
+  std::vector<PrimRef> buildRefs;
+  std::vector<BoundingBox> buildBoxes;
+  std::vector<Vec3d> buildCentroids;
+  std::vector<int> buildIndex;
+  int parallelDepth;
+
+  inline const BoundingBox &primBox(int k) const {
+	return buildBoxes[buildIndex[k]];
+  }
+  inline const Vec3d &primCentroid(int k) const {
+	return buildCentroids[buildIndex[k]];
+  }
+  inline BoundingBox rangeBox(int begin, int end) const {
+	Vec3d min, max;
+	bool init = false;
+	for(int k = begin; k < end; k++) {
+	  updateBox(min, max, primBox(k), init);
+	}
+	return BoundingBox(min, max);
+  }
+
+  // Partition predicates over buildIndex, used with std::partition.
+  struct MidpointPred {
+	const HBV *hbv; int axis; double midPoint;
+	bool operator()(int idx) const {
+	  // straddling the plane or to the bottom/left/closer is in the left
+	  return !(hbv->buildBoxes[idx].min[axis] > midPoint);
+	}
+  };
+  struct BinPred {
+	const HBV *hbv; int axis, split; double cmin, extent;
+	bool operator()(int idx) const {
+	  return hbv->binIndex(hbv->buildCentroids[idx][axis], cmin, extent) < split;
+	}
+  };
+
+  // A subtree handed to another thread.
+  struct BuildTask {
+	HBV *hbv;
+	int begin, end, axis, depth;
+	BoundingBox bbox;
+	HBV_Node *result;
+  };
+  static void buildTaskThread(ThreadPool *tp, void *arg) {
+	BuildTask *task = (BuildTask*)arg;
+	task->result = task->hbv->buildRange(task->begin, task->end, task->bbox, task->axis, task->depth);
+  }
+  HBV_Node *buildRange(int begin, int end, const BoundingBox &bbox, int axis, int depth) {
+	if(options.method == HBVBuildOptions::SAH) {
+	  return buildNodeSAH(begin, end, bbox, depth);
+	}
+	return buildNode(begin, end, bbox, axis, depth);
+  }
+  // Build both children of a node, the left one on another thread while
+  // we are near the top of the tree and the ranges are big enough to be
+  // worth it.
+  HBV_Node *buildChildren(int begin, int mid, int end, const BoundingBox &bbox, int splitAxis, int axis, int depth) {
+	BoundingBox leftBox = rangeBox(begin, mid);
+	BoundingBox rightBox = rangeBox(mid, end);
+	HBV_Node *left_node, *right_node;
+	if(depth < parallelDepth && end - begin >= options.minParallelSize) {
+	  BuildTask task;
+	  task.hbv = this;
+	  task.begin = begin;
+	  task.end = mid;
+	  task.axis = axis;
+	  task.depth = depth + 1;
+	  task.bbox = leftBox;
+	  task.result = NULL;
+	  ThreadPool tp;
+	  if(tp.startThread(buildTaskThread, &task)) {
+		right_node = buildRange(mid, end, rightBox, axis, depth + 1);
+		tp.waitForThreads(ThreadPool::NO_TIMEOUT);
+		left_node = task.result;
+		return new HBV_Node(bbox, left_node, right_node, splitAxis);
+	  }
+	}
+	left_node = buildRange(begin, mid, leftBox, axis, depth + 1);
+	right_node = buildRange(mid, end, rightBox, axis, depth + 1);
+	return new HBV_Node(bbox, left_node, right_node, splitAxis);
+  }
+  HBV_Node *buildNode(int begin, int end, const BoundingBox& bbox, int axis, int depth) {
+	int n = end - begin;
+	if(n == 0) {
 	  return NULL;
-	} else if(input.size() == 1) {
-	  return new HBV_Node(input.at(0));
-	} else if(input.size() == 2) {
-	  return new HBV_Node(bbox, new HBV_Node(input.at(0)), new HBV_Node(input.at(1)));
-	}
-	bool leftInit = false;
-	bool rightInit = false;
-	Vec3d minLeft, minRight, maxLeft, maxRight;
-	double midPoint = bbox.min[axis] + ((bbox.max[axis] - bbox.min[axis]) / 2);
-	std::vector<Geometry*> left, right;
-	//std::cout << "On axis: " << axis << " with midpoint: " << midPoint << " and bbox " << bbox << std::endl;
+	} else if(n == 1) {
+	  return new HBV_Node(bbox, begin, 1);
+	} else if(n == 2) {
+	  return new HBV_Node(bbox, new HBV_Node(primBox(begin), begin, 1),
+						  new HBV_Node(primBox(begin + 1), begin + 1, 1), axis);
+	}
+	MidpointPred pred;
+	pred.hbv = this;
+	pred.axis = axis;
+	pred.midPoint = bbox.min[axis] + ((bbox.max[axis] - bbox.min[axis]) / 2);
 	// above, right, farther away is in the "right" bucket
-	for(int i = 0; i < input.size(); i++) {
-	  Geometry *g = input.at(i);
-	  const BoundingBox& bbox = g->getBoundingBox();
-	  if(bbox.min[axis] > midPoint) {
-		//std::cout << "object with box " << bbox << " is right" << std::endl;
-		right.push_back(g);
-		updateBox(minRight, maxRight, bbox, rightInit);
-		// straddling the plane or to the bottom/left/closer is in the left
-	  } else {
-		//std::cout << "object with box " << bbox << " is left" << std::endl;
-		updateBox(minLeft, maxLeft, bbox, leftInit);
-		left.push_back(g);
-	  }
+	int mid = std::partition(buildIndex.begin() + begin, buildIndex.begin() + end, pred) - buildIndex.begin();
+	if(mid == begin || mid == end) {
+	  mid = begin + n / 2;
 	}
-	if(left.size() == 0 || right.size() == 0) {
-	  left.clear();
-	  right.clear();
-	  int end = input.size() / 2;
-	  leftInit = rightInit = false;
-	  for(int i = 0; i < end; i++) {
-		Geometry *g = input.at(i);
-		const BoundingBox &bbox = g->getBoundingBox();
-		updateBox(minLeft, maxLeft, bbox, leftInit);
-		left.push_back(g);
+	return buildChildren(begin, mid, end, bbox, axis, (axis + 1) % 3, depth);
+  }
+  // One bucket of the binned SAH sweep.
+  struct SAHBin {
+	SAHBin() : count(0), init(false) { }
+	int count;
+	bool init;
+	Vec3d min, max;
+  };
+  static inline Vec3d centroid(const BoundingBox &b) {
+	return (b.min + b.max) / 2;
+  }
+  inline int binIndex(double c, double cmin, double extent) const {
+	int b = (int)(options.sahBins * ((c - cmin) / extent));
+	return std::max(0, std::min(options.sahBins - 1, b));
+  }
+  HBV_Node *buildNodeSAH(int begin, int end, const BoundingBox &bbox, int depth) {
+	int n = end - begin;
+	if(n == 0) {
+	  return NULL;
+	} else if(n == 1) {
+	  return new HBV_Node(bbox, begin, n);
+	}
+	// Bin on the bounds of the centroids rather than of the boxes so that
+	// large primitives don't squeeze everything else into a few bins.
+	Vec3d cmin, cmax;
+	bool cInit = false;
+	for(int k = begin; k < end; k++) {
+	  const Vec3d &c = primCentroid(k);
+	  updateBox(cmin, cmax, BoundingBox(c, c), cInit);
+	}
+
+	double parentArea = bbox.area();
+	if(parentArea <= 0) {
+	  parentArea = 1;
+	}
+	int bestAxis = -1;
+	int bestSplit = 0;
+	double bestCost = DBL_MAX;
+	std::vector<SAHBin> bins(options.sahBins);
+	std::vector<double> rightArea(options.sahBins);
+	std::vector<int> rightCount(options.sahBins);
+	for(int axis = 0; axis < 3; axis++) {
+	  double extent = cmax[axis] - cmin[axis];
+	  if(extent <= 0) {
+		continue;
 	  }
-	  for(int i = end; i < input.size(); i++) {
-		Geometry *g = input.at(i);
-		const BoundingBox &bbox = g->getBoundingBox();
-		updateBox(minRight, maxRight, bbox, rightInit);
-		right.push_back(g);
+	  std::fill(bins.begin(), bins.end(), SAHBin());
+	  for(int k = begin; k < end; k++) {
+		SAHBin &bin = bins[binIndex(primCentroid(k)[axis], cmin[axis], extent)];
+		bin.count++;
+		updateBox(bin.min, bin.max, primBox(k), bin.init);
+	  }
+	  // sweep from the right to get the area and count right of every split plane
+	  Vec3d rmin, rmax;
+	  bool rInit = false;
+	  int count = 0;
+	  for(int s = options.sahBins - 1; s > 0; s--) {
+		if(bins[s].init) {
+		  updateBox(rmin, rmax, BoundingBox(bins[s].min, bins[s].max), rInit);
+		}
+		count += bins[s].count;
+		rightCount[s] = count;
+		rightArea[s] = rInit ? BoundingBox(rmin, rmax).area() : 0;
 	  }
+	  // then sweep from the left and evaluate each plane
+	  Vec3d lmin, lmax;
+	  bool lInit = false;
+	  count = 0;
+	  for(int s = 1; s < options.sahBins; s++) {
+		if(bins[s - 1].init) {
+		  updateBox(lmin, lmax, BoundingBox(bins[s - 1].min, bins[s - 1].max), lInit);
+		}
+		count += bins[s - 1].count;
+		if(count == 0 || rightCount[s] == 0) {
+		  continue;
+		}
+		double leftArea = BoundingBox(lmin, lmax).area();
+		double splitCost = options.traversalCost + options.intersectionCost *
+		  (leftArea * count + rightArea[s] * rightCount[s]) / parentArea;
+		if(splitCost < bestCost) {
+		  bestCost = splitCost;
+		  bestAxis = axis;
+		  bestSplit = s;
+		}
+	  }
+	}
+
+	double leafCost = options.intersectionCost * n;
+	if(n <= options.maxLeafSize && (bestAxis < 0 || leafCost <= bestCost)) {
+	  return new HBV_Node(bbox, begin, n);
+	}
+
+	int mid;
+	if(bestAxis >= 0) {
+	  BinPred pred;
+	  pred.hbv = this;
+	  pred.axis = bestAxis;
+	  pred.split = bestSplit;
+	  pred.cmin = cmin[bestAxis];
+	  pred.extent = cmax[bestAxis] - cmin[bestAxis];
+	  mid = std::partition(buildIndex.begin() + begin, buildIndex.begin() + end, pred) - buildIndex.begin();
+	} else {
+	  // every centroid coincides; there is no plane to split on, so just halve the range
+	  mid = begin + n / 2;
 	}
-	// leftIt should point to the index of the last geometry on the "left", and rightIt shoudl point to the 
-	// index of the first geometry on the "right"
-	//std::cout << "Using bounding box: " << minLeft << " -> " << maxLeft << std::endl;
-	//std::cout << "Using bounding box: " << minRight << " -> " << maxRight << std::endl;
-	HBV_Node *left_node = buildNode(left, BoundingBox(minLeft, maxLeft), (axis + 1) % 3);
-	HBV_Node *right_node = buildNode(right, BoundingBox(minRight, maxRight), (axis + 1) % 3);
-	return new HBV_Node(bbox, left_node, right_node);
+	return buildChildren(begin, mid, end, bbox, std::max(bestAxis, 0), 0, depth);
   }
-  inline void updateBox(Vec3d &min, Vec3d &max, const BoundingBox &bbox, bool &init) {
+  static inline void updateBox(Vec3d &min, Vec3d &max, const BoundingBox &bbox, bool &init) {
 	if(init) {
 	  min = minimum(min, bbox.min);
 	  max = maximum(max, bbox.max);
@@ -149,21 +338,285 @@ private:
 	  init = true;
 	}
   }
+  // Copy the subtree into the linear array in depth first order and
+  // return the index of its root.
+  int flatten(const HBV_Node *node, int &next, int depth) {
+	int index = next++;
+	LinearNode &linear = linearNodes[index];
+	maxDepth = std::max(maxDepth, depth);
+	for(int a = 0; a < 3; a++) {
+	  linear.bounds[0][a] = roundDown(node->bbox.min[a]);
+	  linear.bounds[1][a] = roundUp(node->bbox.max[a]);
+	}
+	linear.axis = node->axis;
+	linear.pad = 0;
+	if(node->isLeaf()) {
+	  linear.offset = node->firstPrim;
+	  linear.count = node->primCount;
+	} else {
+	  linear.count = 0;
+	  flatten(node->left, next, depth + 1);
+	  // the reference may have moved on; index the array again
+	  linearNodes[index].offset = flatten(node->right, next, depth + 1);
+	}
+	return index;
+  }
+  static int countNodes(const HBV_Node *node) {
+	return node->isLeaf() ? 1 : 1 + countNodes(node->left) + countNodes(node->right);
+  }
+  static inline float roundDown(double d) {
+	float f = (float)d;
+	return (f > d) ? nextafterf(f, -FLT_MAX) : f;
+  }
+  static inline float roundUp(double d) {
+	float f = (float)d;
+	return (f < d) ? nextafterf(f, FLT_MAX) : f;
+  }
+  // Same slab test as BoundingBox::intersect, against a linear node.
+  static inline bool intersectNode(const LinearNode &node, const Vec3d &R0, const Vec3d &invd, const int sign[3], double &tMin, double &tMax) {
+	tMin = -1.0e308;
+	tMax = 1.0e308;
+	for(int axis = 0; axis < 3; axis++) {
+	  double t1 = (node.bounds[sign[axis]][axis] - R0[axis]) * invd[axis];
+	  double t2 = (node.bounds[1 - sign[axis]][axis] - R0[axis]) * invd[axis];
+	  tMin = t1 > tMin ? t1 : tMin;
+	  tMax = t2 < tMax ? t2 : tMax;
+	}
+	return tMin <= tMax && tMax >= RAY_EPSILON;
+  }
+  static LinearNode *allocNodes(int count) {
+	void *mem = NULL;
+#ifdef WIN32
+	mem = _aligned_malloc(count * sizeof(LinearNode), 32);
+#else
+	if(posix_memalign(&mem, 32, count * sizeof(LinearNode)) != 0) {
+	  mem = NULL;
+	}
+#endif
+	if(mem == NULL) {
+	  throw std::bad_alloc();
+	}
+	return (LinearNode*)mem;
+  }
+  static void freeNodes(LinearNode *mem) {
+#ifdef WIN32
+	_aligned_free(mem);
+#else
+	free(mem);
+#endif
+  }
+  // SAH cost of the tree: every node weighted by its area relative to the root.
+  double computeCost() const {
+	double rootArea = nodeArea(linearNodes[0]);
+	if(rootArea <= 0) {
+	  rootArea = 1;
+	}
+	double total = 0;
+	for(int k = 0; k < nodeCount; k++) {
+	  double weight = nodeArea(linearNodes[k]) / rootArea;
+	  if(linearNodes[k].count > 0) {
+		total += weight * options.intersectionCost * linearNodes[k].count;
+	  } else {
+		total += weight * options.traversalCost;
+	  }
+	}
+	return total;
+  }
+  static double nodeArea(const LinearNode &node) {
+	double dx = node.bounds[1][0] - node.bounds[0][0];
+	double dy = node.bounds[1][1] - node.bounds[0][1];
+	double dz = node.bounds[1][2] - node.bounds[0][2];
+	return 2.0 * (dx * dy + dy * dz + dz * dx);
+  }
+  // Walk the hierarchy front to back and hand every primitive in the
+  // leaves the ray reaches to the visitor, which returns false to end the
+  // walk early.  The near child of each interior node is taken from the
+  // sign of the ray direction along its split axis and the far one is
+  // remembered on the stack.  Nodes that the ray enters beyond the
+  // visitor's current tMax are skipped, so a visitor that shrinks tMax as
+  // it finds hits culls everything behind them.  The stack can never hold
+  // more entries than the tree is deep.
+  template <class Visitor>
+  void traverse(const ray &r, Visitor &visitor) const {
+	if(nodeCount == 0) {
+	  return;
+	}
+	const Vec3d R0 = r.getPosition();
+	const Vec3d &invd = r.getInverseDirection();
+	const int sign[3] = { r.getSign(0), r.getSign(1), r.getSign(2) };
+
+	int localStack[64];
+	std::vector<int> deepStack;
+	int *stack = localStack;
+	if(maxDepth >= 64) {
+	  deepStack.resize(maxDepth + 1);
+	  stack = &deepStack[0];
+	}
+	int top = 0;
+	int current = 0;
+	for(;;) {
+	  const LinearNode &node = linearNodes[current];
+	  double tMin, tMax;
+	  if(intersectNode(node, R0, invd, sign, tMin, tMax) && tMin <= visitor.tMax) {
+		if(node.count > 0) {
+		  for(int k = node.offset; k < node.offset + node.count; k++) {
+			if(!visitor(primitives[k])) {
+			  return;
+			}
+		  }
+		} else if(sign[node.axis]) {
+		  stack[top++] = current + 1;
+		  current = node.offset;
+		  continue;
+		} else {
+		  stack[top++] = node.offset;
+		  current = current + 1;
+		  continue;
+		}
+	  }
+	  if(top == 0) {
+		break;
+	  }
+	  current = stack[--top];
+	}
+  }
+  // Visitors for traverse().
+  struct ClosestHit {
+	ClosestHit(const ray &ray_, isect &i_) : r(ray_), i(i_), found(false), tMax(DBL_MAX) { }
+	bool operator()(const PrimRef &p) {
+	  isect cur;
+	  if(p.intersect(r, cur) && cur.t < tMax) {
+		i = cur;
+		tMax = cur.t;
+		found = true;
+	  }
+	  return true;
+	}
+	const ray &r;
+	isect &i;
+	bool found;
+	double tMax;
+  };
+  struct AnyHit {
+	AnyHit(const ray &ray_, double t) : r(ray_), found(false), tMax(t) { }
+	bool operator()(const PrimRef &p) {
+	  isect cur;
+	  found = p.intersect(r, cur) && cur.t < tMax;
+	  return !found;
+	}
+	const ray &r;
+	bool found;
+	double tMax;
+  };
+  struct Transmittance {
+	Transmittance(const ray &ray_, double t, Vec3d &a) : r(ray_), tMax(t), atten(a) { }
+	bool operator()(const PrimRef &p) {
+	  return attenuateCrossings(p, r, tMax, atten);
+	}
+	const ray &r;
+	double tMax;
+	Vec3d &atten;
+  };
 public:
-  HBV() : root(NULL) { }
+  HBV() : linearNodes(NULL), nodeCount(0), leafCount(0), maxDepth(0), cost(0), parallelDepth(0) { }
   ~HBV() {
-	delete root;
+	freeNodes(linearNodes);
   }
+  // Closest hit along the ray, for shading.
   bool intersect(const ray& r, isect &i) const {
-	assert(root != NULL);
-	return root->intersect(r, i);
+	ClosestHit visitor(r, i);
+	traverse(r, visitor);
+	return visitor.found;
   }
-  void build(const std::vector<Geometry*> &objects, const BoundingBox &sceneBox) {
-	delete root;
+  // Is anything hit before distance tMax?  Stops at the first hit.
+  bool occluded(const ray& r, double tMax) const {
+	AnyHit visitor(r, tMax);
+	traverse(r, visitor);
+	return visitor.found;
+  }
+  // Multiply atten by the transmissive coefficient of every surface the
+  // ray crosses before distance tMax, stopping as soon as it drops to zero
+  // (see attenuateCrossings()).
+  void transmittance(const ray& r, double tMax, Vec3d &atten) const {
+	Transmittance visitor(r, tMax, atten);
+	traverse(r, visitor);
+  }
+  void build(const std::vector<Geometry*> &objects, const BoundingBox &sceneBox, const HBVBuildOptions &opts = HBVBuildOptions()) {
+	freeNodes(linearNodes);
+	linearNodes = NULL;
+	nodeCount = leafCount = maxDepth = 0;
+	cost = 0;
+	options = opts;
+	options.sahBins = std::max(options.sahBins, 2);
+	options.maxLeafSize = std::min(std::max(options.maxLeafSize, 1), 0xffff);
+
+	// Every level below the root doubles the number of subtrees that can be
+	// built at once, so stop spawning threads after log2(numThreads) levels.
+	parallelDepth = 0;
+	while((1 << parallelDepth) < options.numThreads) {
+	  parallelDepth++;
+	}
+
+	// Objects that split themselves into pieces contribute one primitive
+	// per piece instead of one for the whole object.
+	buildRefs.clear();
+	buildBoxes.clear();
+	for(size_t j = 0; j < objects.size(); j++) {
+	  int pieces = objects[j]->primitiveCount();
+	  if(pieces == 0) {
+		PrimRef ref = { objects[j], -1 };
+		buildRefs.push_back(ref);
+		buildBoxes.push_back(objects[j]->getBoundingBox());
+	  }
+	  for(int k = 0; k < pieces; k++) {
+		PrimRef ref = { objects[j], k };
+		buildRefs.push_back(ref);
+		buildBoxes.push_back(objects[j]->primitiveBounds(k));
+	  }
+	}
+
+	int n = buildRefs.size();
+	if(n == 0) {
+	  primitives.clear();
+	  return;
+	}
+	buildCentroids.resize(n);
+	buildIndex.resize(n);
+	for(int k = 0; k < n; k++) {
+	  buildCentroids[k] = centroid(buildBoxes[k]);
+	  buildIndex[k] = k;
+	}
 	//std::cout << sceneBox.min << " " << sceneBox.max << std::endl;
-	std::vector<Geometry*> partitionList(objects);
-	root = buildNode(partitionList, sceneBox, 0);
+	HBV_Node *root = buildRange(0, n, sceneBox, 0, 0);
+
+	primitives.resize(n);
+	for(int k = 0; k < n; k++) {
+	  primitives[k] = buildRefs[buildIndex[k]];
+	}
+	std::vector<PrimRef>().swap(buildRefs);
+	std::vector<BoundingBox>().swap(buildBoxes);
+	std::vector<Vec3d>().swap(buildCentroids);
+	std::vector<int>().swap(buildIndex);
+
+	nodeCount = countNodes(root);
+	linearNodes = allocNodes(nodeCount);
+	int next = 0;
+	flatten(root, next, 0);
+	delete root;
+
+	for(int k = 0; k < nodeCount; k++) {
+	  if(linearNodes[k].count > 0) {
+		leafCount++;
+	  }
+	}
+	cost = computeCost();
   }
+  // Statistics of the last build, for comparing builders.
+  const HBVBuildOptions &buildOptions() const { return options; }
+  double sahCost() const { return cost; }
+  int nodes() const { return nodeCount; }
+  int leaves() const { return leafCount; }
+  int depth() const { return maxDepth; }
 };
 
 #endif
@@ -1,4 +1,5 @@
 #include <cmath>
+#include <cfloat>
 
 #include "light.h"
 
@@ -9,6 +10,16 @@ using namespace std;
 
 extern bool debugMode;
 
+Vec3d Light::shadowRay( const Vec3d& P, const Vec3d& direction, double maxT ) const
+{
+  Scene *scene = getScene();
+  ray r(P, direction, ray::SHADOW);
+  if(!scene->hasTransmissiveObjects()) {
+	return scene->occluded(r, maxT) ? Vec3d(0,0,0) : Vec3d(1,1,1);
+  }
+  return scene->transmittance(r, maxT);
+}
+
 double DirectionalLight::distanceAttenuation( const Vec3d& P ) const
 {
 	// distance to light is infinite, so f(di) goes to 0.  Return 1.
@@ -18,24 +29,8 @@ double DirectionalLight::distanceAttenuation( const Vec3d& P ) const
 
 Vec3d DirectionalLight::shadowAttenuation( const Vec3d& P ) const
 {
-  Scene *scene = getScene();
-  Vec3d toReturn(1,1,1);
-  Vec3d currP = P;
-  Vec3d lightDirection = getDirection(P);
-  while(true) {
-	isect i;
-	ray r(currP, lightDirection, (enum ray::RayType)3);
-	bool intersection = scene->intersect(r, i);
-	if(!intersection) {
-	  return toReturn;
-	}
-	const Material &m = i.getMaterial();
-	toReturn = prod(toReturn, m.kt(i));
-	if(toReturn.length() == 0) {
-	  return toReturn;
-	}
-	currP = r.at(i.t);
-  }
+  // the light is infinitely far away
+  return shadowRay(P, getDirection(P), DBL_MAX);
 }
 
 Vec3d DirectionalLight::getColor() const
@@ -70,33 +65,7 @@ Vec3d PointLight::getDirection( const Vec3d& P ) const
 
 Vec3d PointLight::shadowAttenuation(const Vec3d& P) const
 {
-  Scene *scene = getScene();
-  Vec3d toReturn(1,1,1);
-  Vec3d currP = P;
-  Vec3d lightDirection = getDirection(P);
-  double maxT;
-  {
-	Vec3d lightVec = position - P;
-	maxT = lightVec.length();
-	ray r(P, lightDirection);
-	Vec3d test = r.at(maxT) - position;
-	assert(test.length() < RAY_EPSILON);
-  }
-  while(true) {
-	isect i;
-	ray r(currP, lightDirection, (enum ray::RayType)3);
-	bool intersection = scene->intersect(r, i);
-	if(!intersection) {
-	  return toReturn;
-	}
-	if(i.t > maxT) {
-	  return toReturn;
-	}
-	const Material &m = i.getMaterial();
-	toReturn = prod(toReturn, m.kt(i));
-	if(toReturn.length() == 0) {
-	  return toReturn;
-	}
-	currP = r.at(i.t);
-  }
+  Vec3d lightVec = position - P;
+  double maxT = lightVec.length();
+  return shadowRay(P, lightVec / maxT, maxT);
 }
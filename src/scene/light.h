@@ -22,11 +22,17 @@ protected:
 	Light( Scene *scene, const Vec3d& col )
 		: SceneElement( scene ), color( col ) {}
 
+	// Attenuation of a shadow ray from P towards the light, which is at
+	// distance maxT along direction.
+	Vec3d shadowRay( const Vec3d& P, const Vec3d& direction, double maxT ) const;
+
 	Vec3d 		color;
 
+#ifndef COMMAND_LINE_ONLY
 public:
 	virtual void glDraw(GLenum lightID) const { }
 	virtual void glDraw() const { }
+#endif
 };
 
 class DirectionalLight
@@ -43,9 +49,11 @@ public:
 protected:
 	Vec3d 		orientation;
 
+#ifndef COMMAND_LINE_ONLY
 public:
 	void glDraw(GLenum lightID) const;
 	void glDraw() const;
+#endif
 };
 
 class PointLight
@@ -84,9 +92,11 @@ protected:
 	float linearTerm;		// b
 	float quadraticTerm;	// c
 
+#ifndef COMMAND_LINE_ONLY
 public:
 	void glDraw(GLenum lightID) const;
 	void glDraw() const;
+#endif
 
 protected:
 };
@@ -149,6 +149,10 @@ public:
 	// mapped; use this to determine if we need to somehow renormalize.
 	bool mapped() const { return _textureMap != 0; }
 
+	// True if the parameter is an unmapped constant zero.
+	bool isZero() const
+	  { return _textureMap == 0 && _value[0] == 0.0 && _value[1] == 0.0 && _value[2] == 0.0; }
+
 private:
     Vec3d _value;
     TextureMap* _textureMap;
@@ -213,6 +217,9 @@ public:
 
     double index( const isect& i ) const { return _index.intensityValue(i); }
 
+    // Can light pass through this material at all?
+    bool transmissive() const { return !_kt.isZero(); }
+
     // setting functions accepting primitives (Vec3d and double)
     void setEmissive( const Vec3d& ke )     { _ke.setValue( ke ); }
     void setAmbient( const Vec3d& ka )      { _ka.setValue( ka ); }
@@ -17,7 +17,8 @@
 class SceneObject;
 
 // A ray has a position where the ray starts, and a direction (which should
-// always be normalized!)
+// always be normalized!)  It also carries the reciprocal of its direction
+// and the sign of each component, so that box tests only need to multiply.
 
 class ray {
 public:
@@ -31,25 +32,44 @@ public:
 
 
 	ray( const Vec3d& pp, const Vec3d& dd, RayType tt = VISIBILITY )
-		: p( pp ), d( dd ), t( tt ) {}
+		: p( pp ), d( dd ), t( tt ) { setInverse(); }
 	ray( const ray& other ) 
-		: p( other.p ), d( other.d ), t( other.t ) {}
+		: p( other.p ), d( other.d ), invd( other.invd ), t( other.t )
+	{ sign[0] = other.sign[0]; sign[1] = other.sign[1]; sign[2] = other.sign[2]; }
 	~ray() {}
 
 	ray& operator =( const ray& other ) 
-	{ p = other.p; d = other.d; return *this; }
+	{
+		p = other.p; d = other.d; invd = other.invd; t = other.t;
+		sign[0] = other.sign[0]; sign[1] = other.sign[1]; sign[2] = other.sign[2];
+		return *this;
+	}
 
 	Vec3d at( double t ) const
 	{ return p + (t*d); }
 
 	Vec3d getPosition() const { return p; }
 	Vec3d getDirection() const { return d; }
+	// 1/d per component; a zero component gives an infinity of its sign
+	const Vec3d& getInverseDirection() const { return invd; }
+	// 1 if the direction is negative along axis, else 0
+	int getSign( int axis ) const { return sign[axis]; }
 
 	RayType type() const	{ return t; }
 
 protected:
+	void setInverse()
+	{
+		for( int k = 0; k < 3; ++k ) {
+			invd[k] = 1.0 / d[k];
+			sign[k] = invd[k] < 0;
+		}
+	}
+
 	Vec3d p;
 	Vec3d d;
+	Vec3d invd;
+	int sign[3];
 	RayType t; 
 };
 
@@ -119,7 +139,10 @@ public:
     Vec2d uvCoordinates;
     Material *material;         // if this intersection has its own material
                                 // (as opposed to one in its associated object)
-                                // as in the case where the material was interpolated
+                                // as in the case where the material was interpolated.
+                                // Only set it in that case: it is heap allocated
+                                // and copied along with the isect, so primitives
+                                // with a single material should just set obj.
 
     const Material &getMaterial() const;
     // Other info here.
@@ -0,0 +1,106 @@
+#include <mutex>
+#include <algorithm>
+
+#include "raystats.h"
+
+// Every live thread's counters, plus what exited threads left behind.
+static std::mutex& registryLock()
+{
+	static std::mutex lock;
+	return lock;
+}
+
+static std::vector<RayStats*>& registry()
+{
+	static std::vector<RayStats*> stats;
+	return stats;
+}
+
+static RayCounts& retired()
+{
+	static RayCounts counts;
+	return counts;
+}
+
+RayCounts::RayCounts()
+	: hits( 0 )
+{
+	rays[0] = rays[1] = rays[2] = rays[3] = 0;
+}
+
+RayStats::RayStats()
+	: hits( 0 )
+{
+	for( int k = 0; k < 4; ++k )
+		rays[k].store( 0 );
+
+	std::lock_guard<std::mutex> guard( registryLock() );
+	registry().push_back( this );
+}
+
+RayStats::~RayStats()
+{
+	std::lock_guard<std::mutex> guard( registryLock() );
+	addTo( retired() );
+	std::vector<RayStats*>& stats = registry();
+	stats.erase( std::remove( stats.begin(), stats.end(), this ), stats.end() );
+}
+
+RayStats& RayStats::local()
+{
+	static thread_local RayStats stats;
+	return stats;
+}
+
+void RayStats::addTo( RayCounts& counts ) const
+{
+	for( int k = 0; k < 4; ++k )
+		counts.rays[k] += rays[k].load( std::memory_order_relaxed );
+	counts.hits += hits.load( std::memory_order_relaxed );
+}
+
+RayCounts RayStats::total()
+{
+	std::lock_guard<std::mutex> guard( registryLock() );
+	RayCounts counts = retired();
+	const std::vector<RayStats*>& stats = registry();
+	for( size_t s = 0; s < stats.size(); ++s )
+		stats[s]->addTo( counts );
+	return counts;
+}
+
+void RayStats::reset()
+{
+	std::lock_guard<std::mutex> guard( registryLock() );
+	retired() = RayCounts();
+	const std::vector<RayStats*>& stats = registry();
+	for( size_t s = 0; s < stats.size(); ++s ) {
+		for( int k = 0; k < 4; ++k )
+			stats[s]->rays[k].store( 0, std::memory_order_relaxed );
+		stats[s]->hits.store( 0, std::memory_order_relaxed );
+	}
+}
+
+
+RayCapture& RayCapture::local()
+{
+	static thread_local RayCapture capture;
+	return capture;
+}
+
+void RayCapture::enable( size_t cap )
+{
+	on = true;
+	capacity = std::max( cap, (size_t)1 );
+	clear();
+}
+
+void RayCapture::add( const ray& r, const isect& i )
+{
+	if( entries.size() < capacity ) {
+		entries.push_back( Entry( r, i ) );
+		return;
+	}
+	entries[next] = Entry( r, i );
+	next = (next + 1) % capacity;
+}
@@ -0,0 +1,103 @@
+//
+// raystats.h
+//
+// Per-thread bookkeeping for the rays the scene is asked about: counters
+// that are always on, and an optional capture of the rays themselves for
+// the debugging view.  Each thread only ever writes its own copy, so
+// neither needs a lock on the tracing path.
+//
+
+#ifndef __RAYSTATS_H__
+#define __RAYSTATS_H__
+
+#include <atomic>
+#include <utility>
+#include <vector>
+
+#include "ray.h"
+
+// A snapshot of the counters.
+struct RayCounts
+{
+	RayCounts();
+
+	unsigned long long rays[4];		// queries by ray::RayType
+	unsigned long long hits;		// closest-hit queries that hit something
+
+	unsigned long long total() const { return rays[0] + rays[1] + rays[2] + rays[3]; }
+};
+
+class RayStats
+{
+public:
+	// The calling thread's counters.
+	static RayStats& local();
+	// Sum over every thread, including threads that have exited.  Other
+	// threads may still be counting, so this is only exact once they stop.
+	static RayCounts total();
+	// Zero every thread's counters; only call while no one is tracing.
+	static void reset();
+
+	void countRay( ray::RayType t ) { bump( rays[t] ); }
+	void countHit() { bump( hits ); }
+	// Rays this copy has counted, of every type; cheap enough to ask
+	// after every pixel.
+	unsigned long long rayCount() const
+	{
+		return rays[0].load( std::memory_order_relaxed ) + rays[1].load( std::memory_order_relaxed )
+			+ rays[2].load( std::memory_order_relaxed ) + rays[3].load( std::memory_order_relaxed );
+	}
+
+	~RayStats();
+
+private:
+	RayStats();
+	RayStats( const RayStats& );
+	RayStats& operator=( const RayStats& );
+
+	// Only the owning thread writes, so a plain load and store is enough;
+	// the atomics just make reading from other threads well defined.
+	static void bump( std::atomic<unsigned long long>& c )
+		{ c.store( c.load( std::memory_order_relaxed ) + 1, std::memory_order_relaxed ); }
+
+	void addTo( RayCounts& counts ) const;
+
+	std::atomic<unsigned long long> rays[4];
+	std::atomic<unsigned long long> hits;
+};
+
+// The most recent rays (and where they hit) traced on one thread, kept in
+// a fixed size ring.  Off unless enabled; the debugging view turns it on
+// while tracing a single ray.
+class RayCapture
+{
+public:
+	typedef std::pair<ray, isect> Entry;
+
+	// The calling thread's capture.
+	static RayCapture& local();
+
+	// Start capturing, keeping at most capacity rays, and clear out what
+	// was there.  disable() stops capturing but keeps the rays.
+	void enable( size_t capacity = 4096 );
+	void disable() { on = false; }
+	bool enabled() const { return on; }
+
+	void clear() { entries.clear(); next = 0; }
+	void add( const ray& r, const isect& i );
+
+	// Captured rays, oldest first.
+	size_t size() const { return entries.size(); }
+	const Entry& operator[]( size_t k ) const
+		{ return entries[(next + k) % entries.size()]; }
+
+private:
+	RayCapture() : on( false ), capacity( 0 ), next( 0 ) { }
+
+	bool on;
+	size_t capacity;
+	size_t next;				// oldest entry once the ring is full
+	std::vector<Entry> entries;
+};
+
+#endif // __RAYSTATS_H__
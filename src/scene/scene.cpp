@@ -2,9 +2,8 @@
 
 #include "scene.h"
 #include "light.h"
-#include "../ui/TraceUI.h"
 #include "hbv.h"
-extern TraceUI* traceUI;
+#include "raystats.h"
 
 using namespace std;
 
@@ -33,55 +32,107 @@ bool BoundingBox::intersects(const Vec3d& point) const
 // closest to the origin in tMin and the "t" value of the far intersection
 // in tMax and return true, else return false.
 // Using Kay/Kajiya algorithm.
+//
+// The ray's sign bits pick the near and far plane of each slab, and its
+// reciprocal direction turns the divisions into multiplies.  A ray
+// parallel to a slab gets +/-infinity from both planes when it is outside
+// the slab (so the box is missed) and -/+infinity when it is inside.  If
+// it lies exactly on a plane, 0 * infinity gives NaN, which the
+// comparisons below ignore, so that axis just doesn't clip the interval.
 bool BoundingBox::intersect(const ray& r, double& tMin, double& tMax) const
 {
-	Vec3d R0 = r.getPosition();
-	Vec3d Rd = r.getDirection();
+	const Vec3d R0 = r.getPosition();
+	const Vec3d &invd = r.getInverseDirection();
 
 	tMin = -1.0e308; // 1.0e308 is close to infinity... close enough for us!
 	tMax = 1.0e308;
-	double ttemp;
 	
 	for (int currentaxis = 0; currentaxis < 3; currentaxis++)
 	{
-		double vd = Rd[currentaxis];
-		
-		// if the ray is parallel to the face's plane (=0.0)
-		if( vd == 0.0 ) {
-			if( R0[currentaxis] < min[currentaxis] || R0[currentaxis] > max[currentaxis] )
-				return false;
-			continue;
-		}
+		int s = r.getSign(currentaxis);
+		double t1 = ((s ? max : min)[currentaxis] - R0[currentaxis]) * invd[currentaxis];
+		double t2 = ((s ? min : max)[currentaxis] - R0[currentaxis]) * invd[currentaxis];
 
-		double v1 = min[currentaxis] - R0[currentaxis];
-		double v2 = max[currentaxis] - R0[currentaxis];
-
-		// two slab intersections
-		double t1 = v1/vd;
-		double t2 = v2/vd;
-		
-		if ( t1 > t2 ) { // swap t1 & t2
-			ttemp = t1;
-			t1 = t2;
-			t2 = ttemp;
-		}
+		tMin = t1 > tMin ? t1 : tMin;
+		tMax = t2 < tMax ? t2 : tMax;
+	}
 
-		if (t1 > tMin)
-			tMin = t1;
-		if (t2 < tMax)
-			tMax = t2;
+	// box is missed, or is behind the ray
+	return tMin <= tMax && tMax >= RAY_EPSILON;
+}
 
-		if (tMin > tMax) // box is missed
-			return false;
-		if (tMax < RAY_EPSILON) // box is behind ray
-			return false;
-	}
-	return true; // it made it past all 3 axes.
+double BoundingBox::area() const
+{
+	Vec3d d = max - min;
+	return 2.0 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
 }
 
 
+void TransformNode::classify()
+{
+	const double *m = xform.n;
+	offset = Vec3d( m[3], m[7], m[11] );
+	scaleFactor = 1.0;
+	kind = GENERAL;
+
+	// only affine transforms with no rotation or shear qualify
+	if( m[12] != 0.0 || m[13] != 0.0 || m[14] != 0.0 || m[15] != 1.0 )
+		return;
+	if( m[1] != 0.0 || m[2] != 0.0 || m[4] != 0.0 || m[6] != 0.0 || m[8] != 0.0 || m[9] != 0.0 )
+		return;
+	if( m[0] != m[5] || m[0] != m[10] || m[0] <= 0.0 )
+		return;
+
+	if( m[0] != 1.0 ) {
+		kind = UNIFORM_SCALE;
+		scaleFactor = m[0];
+	} else if( !offset.iszero() ) {
+		kind = TRANSLATION;
+	} else {
+		kind = IDENTITY;
+	}
+}
+
 bool Geometry::intersect(const ray&r, isect&i) const
 {
+	return intersectTransformed( -1, r, i );
+}
+
+bool Geometry::intersectPrimitive( int k, const ray& r, isect& i ) const
+{
+	return intersectTransformed( k, r, i );
+}
+
+bool Geometry::intersectTransformed( int k, const ray& r, isect& i ) const
+{
+	// Every intersectLocal returns a unit normal, and none of the simple
+	// transforms change its direction, so those only need the ray moved
+	// (and t scaled).
+	switch( transform->getKind() ) {
+	case TransformNode::IDENTITY:
+		return intersectIn( k, r, i );
+
+	case TransformNode::TRANSLATION:
+	{
+		ray localRay( r.getPosition() - transform->getTranslation(), r.getDirection(), r.type() );
+		return intersectIn( k, localRay, i );
+	}
+
+	case TransformNode::UNIFORM_SCALE:
+	{
+		double s = transform->getScale();
+		ray localRay( (r.getPosition() - transform->getTranslation()) / s, r.getDirection(), r.type() );
+		if( intersectIn( k, localRay, i ) ) {
+			i.t *= s;
+			return true;
+		}
+		return false;
+	}
+
+	default:
+		break;
+	}
+
     // Transform the ray into the object's local coordinate space
     Vec3d pos = transform->globalToLocalCoords(r.getPosition());
     Vec3d dir = transform->globalToLocalCoords(r.getPosition() + r.getDirection()) - pos;
@@ -90,7 +141,7 @@ bool Geometry::intersect(const ray&r, isect&i) const
 
     ray localRay( pos, dir, r.type() );
 
-    if (intersectLocal(localRay, i)) {
+    if (intersectIn(k, localRay, i)) {
         // Transform the intersection point & normal returned back into global space.
 		i.N = transform->localToGlobalCoordsNormal(i.N);
 		i.t /= length;
@@ -99,7 +150,41 @@ bool Geometry::intersect(const ray&r, isect&i) const
     } else {
         return false;
     }
-    
+}
+
+BoundingBox Geometry::localToGlobalBounds( const BoundingBox& localBounds ) const
+{
+	Vec3d min = localBounds.min;
+	Vec3d max = localBounds.max;
+
+	Vec4d v, newMax, newMin;
+
+	v = transform->localToGlobalCoords( Vec4d(min[0], min[1], min[2], 1) );
+	newMax = v;
+	newMin = v;
+	v = transform->localToGlobalCoords( Vec4d(max[0], min[1], min[2], 1) );
+	newMax = maximum(newMax, v);
+	newMin = minimum(newMin, v);
+	v = transform->localToGlobalCoords( Vec4d(min[0], max[1], min[2], 1) );
+	newMax = maximum(newMax, v);
+	newMin = minimum(newMin, v);
+	v = transform->localToGlobalCoords( Vec4d(max[0], max[1], min[2], 1) );
+	newMax = maximum(newMax, v);
+	newMin = minimum(newMin, v);
+	v = transform->localToGlobalCoords( Vec4d(min[0], min[1], max[2], 1) );
+	newMax = maximum(newMax, v);
+	newMin = minimum(newMin, v);
+	v = transform->localToGlobalCoords( Vec4d(max[0], min[1], max[2], 1) );
+	newMax = maximum(newMax, v);
+	newMin = minimum(newMin, v);
+	v = transform->localToGlobalCoords( Vec4d(min[0], max[1], max[2], 1) );
+	newMax = maximum(newMax, v);
+	newMin = minimum(newMin, v);
+	v = transform->localToGlobalCoords( Vec4d(max[0], max[1], max[2], 1) );
+	newMax = maximum(newMax, v);
+	newMin = minimum(newMin, v);
+
+	return BoundingBox( Vec3d(newMin), Vec3d(newMax) );
 }
 
 bool Geometry::hasBoundingBoxCapability() const
@@ -145,9 +230,12 @@ bool Scene::intersect( const ray& r, isect& i ) const
 
 	bool have_one = false;
 	
+	// Without the bvh, the bounded objects get tested one by one too
+	const vector<Geometry*>& scanned = accelerated ? nonboundedobjects : objects;
 	assert(hbv != NULL);
-	have_one = hbv->intersect(r, i);
-	for( iter j = nonboundedobjects.begin(); j != nonboundedobjects.end(); ++j ) {
+	if( accelerated )
+		have_one = hbv->intersect(r, i);
+	for( iter j = scanned.begin(); j != scanned.end(); ++j ) {
 	  isect cur;
 	  if( (*j)->intersect( r, cur ) ) {
 		if( !have_one || (cur.t < i.t) ) {
@@ -160,16 +248,77 @@ bool Scene::intersect( const ray& r, isect& i ) const
 	if( !have_one )
 		i.setT(1000.0);
 
+	RayStats &stats = RayStats::local();
+	stats.countRay(r.type());
+	if( have_one )
+		stats.countHit();
+
 	// if debugging,
-	if (!traceUI->isMultithreading())
-		intersectCache.push_back( std::make_pair(r,i) );
+	RayCapture &capture = RayCapture::local();
+	if( capture.enabled() )
+		capture.add( r, i );
 
 	return have_one;
 }
 
-void Scene::indexObjects() {
+bool Scene::occluded( const ray& r, double tMax ) const
+{
+	typedef vector<Geometry*>::const_iterator iter;
+
+	const vector<Geometry*>& scanned = accelerated ? nonboundedobjects : objects;
+	bool blocked = accelerated && hbv->occluded(r, tMax);
+	for( iter j = scanned.begin(); !blocked && j != scanned.end(); ++j ) {
+	  isect cur;
+	  blocked = (*j)->intersect( r, cur ) && cur.t < tMax;
+	}
+
+	RayStats::local().countRay(r.type());
+
+	// if debugging,
+	RayCapture &capture = RayCapture::local();
+	if( capture.enabled() ) {
+		isect i;
+		i.setT(tMax);
+		capture.add( r, i );
+	}
+
+	return blocked;
+}
+
+Vec3d Scene::transmittance( const ray& r, double tMax ) const
+{
+	typedef vector<Geometry*>::const_iterator iter;
+
+	const vector<Geometry*>& scanned = accelerated ? nonboundedobjects : objects;
+	Vec3d atten(1.0, 1.0, 1.0);
+	if( accelerated )
+		hbv->transmittance(r, tMax, atten);
+	for( iter j = scanned.begin(); !atten.iszero() && j != scanned.end(); ++j )
+	  attenuateCrossings( **j, r, tMax, atten );
+
+	RayStats::local().countRay(r.type());
+
+	// if debugging,
+	RayCapture &capture = RayCapture::local();
+	if( capture.enabled() ) {
+		isect i;
+		i.setT(tMax);
+		capture.add( r, i );
+	}
+
+	return atten;
+}
+
+void Scene::indexObjects( const HBVBuildOptions& options ) {
+  delete hbv;
   hbv = new HBV();
-  hbv->build(boundedobjects, sceneBounds);
+  hbv->build(boundedobjects, sceneBounds, options);
+
+  transmissiveObjects = false;
+  for( cgiter g = objects.begin(); g != objects.end() && !transmissiveObjects; ++g ) {
+	const SceneObject *obj = dynamic_cast<const SceneObject*>(*g);
+	transmissiveObjects = obj && obj->hasTransmissiveMaterial();
+  }
 }
 
 
@@ -25,6 +25,7 @@
 class Light;
 class Scene;
 class HBV;
+struct HBVBuildOptions;
 
 class SceneElement
 {
@@ -63,10 +64,27 @@ public:
 	// closest to the origin in tMin and the "t" value of the far intersection
 	// in tMax and return true, else return false.
 	bool intersect(const ray& r, double& tMin, double& tMax) const;
+
+	// surface area of the box, used by the SAH builder.
+	double area() const;
 };
 
 class TransformNode
 {
+public:
+	// What the transformation does, worked out once when the node is made
+	// so that Geometry::intersect can skip the matrix work for the common
+	// cases.  UNIFORM_SCALE is a positive scale about the origin followed
+	// by a translation; anything with rotation, shear or a non-uniform or
+	// negative scale is GENERAL.
+	enum Kind
+	{
+		IDENTITY,
+		TRANSLATION,
+		UNIFORM_SCALE,
+		GENERAL
+	};
+
 protected:
 
     // information about this node's transformation
@@ -74,6 +92,10 @@ protected:
 	Mat4d    inverse;
 	Mat3d    normi;
 
+	Kind     kind;
+	Vec3d    offset;		// translation part of xform
+	double   scaleFactor;	// scale of a UNIFORM_SCALE transform, else 1
+
     // information about parent & children
     TransformNode *parent;
     std::vector<TransformNode*> children;
@@ -119,6 +141,11 @@ public:
     }
 
 	const Mat4d& transform() const		{ return xform; }
+	const Mat3d& normalTransform() const	{ return normi; }
+
+	Kind getKind() const				{ return kind; }
+	const Vec3d& getTranslation() const	{ return offset; }
+	double getScale() const				{ return scaleFactor; }
 
 protected:
     // protected so that users can't directly construct one of these...
@@ -135,7 +162,10 @@ protected:
         
         inverse = this->xform.inverse();
         normi = this->xform.upper33().inverse().transpose();
+        classify();
     }
+
+    void classify();
 };
 
 class TransformRoot : public TransformNode
@@ -154,54 +184,48 @@ class Geometry
 public:
     // intersections performed in the global coordinate space.
     bool intersect(const ray&r, isect&i) const;
+
+	// Geometry made of many small pieces (a trimesh) hands each piece to
+	// the acceleration structure by index instead of being bounded as a
+	// whole, so that the pieces don't each need an object of their own.
+	// Pieces are numbered 0 .. primitiveCount()-1; geometry that isn't
+	// split up returns 0.
+	virtual int primitiveCount() const { return 0; }
+	// global-space bounding box of piece k
+	virtual BoundingBox primitiveBounds( int k ) const { return bounds; }
+	// intersect piece k, in the global coordinate space
+	bool intersectPrimitive( int k, const ray& r, isect& i ) const;
     
 protected:
     // intersections performed in the object's local coordinate space
     // do not call directly - this should only be called by intersect()
 	virtual bool intersectLocal( const ray& r, isect& i ) const = 0;
 
+	// intersect piece k in the object's local coordinate space; only
+	// called by intersectPrimitive()
+	virtual bool intersectPrimitiveLocal( int k, const ray& r, isect& i ) const { return false; }
+
+private:
+	// does the work of intersect() and intersectPrimitive(); k < 0 means
+	// the whole object
+	bool intersectTransformed( int k, const ray& r, isect& i ) const;
+	bool intersectIn( int k, const ray& r, isect& i ) const
+	{
+		return k < 0 ? intersectLocal( r, i ) : intersectPrimitiveLocal( k, r, i );
+	}
+
+protected:
+
+	// take a local bounding box, transform all 8 points on it,
+	// and use those to find the global box around it.
+	BoundingBox localToGlobalBounds( const BoundingBox& localBounds ) const;
+
 public:
 	virtual bool hasBoundingBoxCapability() const;
 	const BoundingBox& getBoundingBox() const { return bounds; }
 	virtual void ComputeBoundingBox()
     {
-        // take the object's local bounding box, transform all 8 points on it,
-        // and use those to find a new bounding box.
-
-        BoundingBox localBounds = ComputeLocalBoundingBox();
-        
-        Vec3d min = localBounds.min;
-		Vec3d max = localBounds.max;
-
-		Vec4d v, newMax, newMin;
-
-		v = transform->localToGlobalCoords( Vec4d(min[0], min[1], min[2], 1) );
-		newMax = v;
-		newMin = v;
-		v = transform->localToGlobalCoords( Vec4d(max[0], min[1], min[2], 1) );
-		newMax = maximum(newMax, v);
-		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords( Vec4d(min[0], max[1], min[2], 1) );
-		newMax = maximum(newMax, v);
-		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords( Vec4d(max[0], max[1], min[2], 1) );
-		newMax = maximum(newMax, v);
-		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords( Vec4d(min[0], min[1], max[2], 1) );
-		newMax = maximum(newMax, v);
-		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords( Vec4d(max[0], min[1], max[2], 1) );
-		newMax = maximum(newMax, v);
-		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords( Vec4d(min[0], max[1], max[2], 1) );
-		newMax = maximum(newMax, v);
-		newMin = minimum(newMin, v);
-		v = transform->localToGlobalCoords( Vec4d(max[0], max[1], max[2], 1) );
-		newMax = maximum(newMax, v);
-		newMin = minimum(newMin, v);
-		
-		bounds.max = Vec3d(newMax);
-		bounds.min = Vec3d(newMin);
+        bounds = localToGlobalBounds( ComputeLocalBoundingBox() );
     }
 
     // default method for ComputeLocalBoundingBox returns a bogus bounding box;
@@ -213,12 +237,14 @@ public:
 	Geometry( Scene *scene ) 
 		: SceneElement( scene ) {}
 
+#ifndef COMMAND_LINE_ONLY
 	// For debugging purposes, draws using OpenGL
 	void glDraw(int quality, bool actualMaterials, bool actualTextures) const;
 
 	// The defult does nothing; this is here because it is not required
 	// that you implement this function if you create your own scene objects.
 	virtual void glDrawLocal(int quality, bool actualMaterials, bool actualTextures) const { }
+#endif
 
 protected:
 	BoundingBox bounds;
@@ -236,7 +262,12 @@ public:
 	virtual const Material& getMaterial() const = 0;
 	virtual void setMaterial( Material *m ) = 0;
 
+	// Could any point on this object let light through?
+	virtual bool hasTransmissiveMaterial() const { return getMaterial().transmissive(); }
+
+#ifndef COMMAND_LINE_ONLY
 	void glDraw(int quality, bool actualMaterials, bool actualTextures) const;
+#endif
 
 protected:
 	SceneObject( Scene *scene )
@@ -274,7 +305,7 @@ public:
 
 public:
 	Scene() 
-	  : transformRoot(), objects(), lights(), hbv(NULL)
+	  : transformRoot(), objects(), lights(), hbv(NULL), transmissiveObjects(true), accelerated(true)
 		{}
 	virtual ~Scene();
 
@@ -300,6 +331,23 @@ public:
 
 	bool intersect( const ray& r, isect& i ) const;
 
+	// Queries for shadow rays.  occluded() stops at the first hit before
+	// tMax; transmittance() returns the product of the transmissive
+	// coefficients at every surface crossed before tMax, entering and
+	// leaving, stopping early once it reaches zero.
+	bool occluded( const ray& r, double tMax ) const;
+	Vec3d transmittance( const ray& r, double tMax ) const;
+
+	// Whether the queries above go through the bvh, or just test every
+	// object in turn, which is slow but makes a handy reference when
+	// something looks wrong.  Only change it while nothing is tracing.
+	void setAccelerated( bool on )	{ accelerated = on; }
+	bool isAccelerated() const		{ return accelerated; }
+
+	// Does any object in the scene let light through?  If not, shadow
+	// rays only need occluded().
+	bool hasTransmissiveObjects() const	{ return transmissiveObjects; }
+
 
 	std::vector<Light*>::const_iterator beginLights() const { return lights.begin(); }
 	std::vector<Light*>::const_iterator endLights() const { return lights.end(); }
@@ -318,10 +366,13 @@ public:
 	Vec3d ambient() const	{ return ambientIntensity; }
 	void addAmbient( const Vec3d& ambient ) { ambientIntensity += ambient; }
 
+#ifndef COMMAND_LINE_ONLY
 	void glDraw(int quality, bool actualMaterials, bool actualTextures) const;
+#endif
 
 	const BoundingBox& bounds() const		{ return sceneBounds; }
-	void indexObjects();
+	void indexObjects( const HBVBuildOptions& options );
+	const HBV* getHBV() const			{ return hbv; }
 
 private:
     std::vector<Geometry*> objects;
@@ -331,6 +382,8 @@ private:
     Camera camera;
 
 	HBV *hbv;
+	bool transmissiveObjects;
+	bool accelerated;
 
 	// This is the total amount of ambient light in the scene
 	// (used as the I_a in the Phong shading model)
@@ -344,10 +397,6 @@ private:
 	// are exempt from this requirement.
 	BoundingBox sceneBounds;
 
-
-public:
-	// This is used for debugging purposes only.
-	mutable std::vector< std::pair<ray, isect> > intersectCache;
 };
 
 #endif // __SCENE_H__
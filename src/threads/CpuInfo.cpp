@@ -0,0 +1,235 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include "CpuInfo.h"
+
+#ifdef WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifdef __linux__
+
+// Parse a kernel cpu list such as "0-3,8,10-11".
+static void parseCpuList(const std::string& list, std::vector<int>& cpus) {
+	std::stringstream ss(list);
+	std::string range;
+	while (std::getline(ss, range, ',')) {
+		int lo, hi;
+		int n = sscanf(range.c_str(), "%d-%d", &lo, &hi);
+		if (n == 1)
+			hi = lo;
+		else if (n != 2)
+			continue;
+		for (int c = lo; c <= hi; c++)
+			cpus.push_back(c);
+	}
+}
+
+// CPUs allowed by a cgroup CPU quota, or 0 if there is none.  Every
+// level from the process's own cgroup up to the root can set one; the
+// tightest wins.
+static int cgroupQuota() {
+	std::ifstream cgroups("/proc/self/cgroup");
+	std::string line;
+	double limit = 0;
+	while (std::getline(cgroups, line)) {
+		// "hierarchy-id:controllers:path"
+		size_t a = line.find(':');
+		size_t b = line.find(':', a + 1);
+		if (a == std::string::npos || b == std::string::npos)
+			continue;
+		std::string controllers = line.substr(a + 1, b - a - 1);
+		std::string path = line.substr(b + 1);
+
+		bool v2 = controllers.empty();
+		std::string root;
+		if (v2) {
+			root = "/sys/fs/cgroup";
+		} else {
+			std::stringstream ss(controllers);
+			std::string c;
+			bool cpu = false;
+			while (std::getline(ss, c, ','))
+				cpu = cpu || c == "cpu";
+			if (!cpu)
+				continue;
+			root = "/sys/fs/cgroup/" + controllers;
+			std::ifstream probe((root + "/cpu.cfs_period_us").c_str());
+			if (!probe)
+				root = "/sys/fs/cgroup/cpu";
+		}
+
+		for (;;) {
+			std::string dir = root + path;
+			double quota = -1, period = 0;
+			if (v2) {
+				// "max 100000" or "<quota> <period>"
+				std::ifstream f((dir + "/cpu.max").c_str());
+				std::string q;
+				if (f >> q >> period && q != "max")
+					quota = atof(q.c_str());
+			} else {
+				std::ifstream q((dir + "/cpu.cfs_quota_us").c_str());
+				std::ifstream p((dir + "/cpu.cfs_period_us").c_str());
+				if (!(q >> quota) || !(p >> period))
+					quota = -1;
+			}
+			if (quota > 0 && period > 0 && (limit == 0 || quota / period < limit))
+				limit = quota / period;
+
+			if (path.empty() || path == "/")
+				break;
+			size_t slash = path.rfind('/');
+			path = slash == 0 || slash == std::string::npos ? "/" : path.substr(0, slash);
+		}
+	}
+	return limit > 0 ? std::max(1, (int)ceil(limit)) : 0;
+}
+
+#endif
+
+CpuInfo::CpuInfo()
+	: numAvailable(0)
+{
+#ifdef WIN32
+	DWORD_PTR processMask, systemMask;
+	if (GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask)) {
+		for (int c = 0; c < (int)(8 * sizeof(DWORD_PTR)); c++) {
+			if (processMask & ((DWORD_PTR)1 << c))
+				cpuIds.push_back(c);
+		}
+	}
+	for (size_t i = 0; i < cpuIds.size(); i++) {
+		UCHAR node = 0;
+		if (GetNumaProcessorNode((UCHAR)cpuIds[i], &node) && node != 0xff) {
+			if ((int)cpuNode.size() <= cpuIds[i])
+				cpuNode.resize(cpuIds[i] + 1, 0);
+			cpuNode[cpuIds[i]] = node;
+		}
+	}
+#elif defined(__linux__)
+	cpu_set_t mask;
+	CPU_ZERO(&mask);
+	if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+		for (int c = 0; c < CPU_SETSIZE; c++) {
+			if (CPU_ISSET(c, &mask))
+				cpuIds.push_back(c);
+		}
+	}
+	DIR* nodes = opendir("/sys/devices/system/node");
+	if (nodes) {
+		while (struct dirent* entry = readdir(nodes)) {
+			int node;
+			if (sscanf(entry->d_name, "node%d", &node) != 1)
+				continue;
+			std::ifstream f((std::string("/sys/devices/system/node/") + entry->d_name + "/cpulist").c_str());
+			std::string list;
+			std::vector<int> cpus;
+			if (std::getline(f, list))
+				parseCpuList(list, cpus);
+			for (size_t i = 0; i < cpus.size(); i++) {
+				if ((int)cpuNode.size() <= cpus[i])
+					cpuNode.resize(cpus[i] + 1, 0);
+				cpuNode[cpus[i]] = node;
+			}
+		}
+		closedir(nodes);
+	}
+#endif
+
+	if (cpuIds.empty()) {
+		int n = std::max(1u, std::thread::hardware_concurrency());
+		for (int c = 0; c < n; c++)
+			cpuIds.push_back(c);
+	}
+	numAvailable = (int)cpuIds.size();
+
+#ifdef __linux__
+	int quota = cgroupQuota();
+	if (quota > 0)
+		numAvailable = std::min(numAvailable, quota);
+#endif
+}
+
+const CpuInfo& CpuInfo::system() {
+	static CpuInfo info;
+	return info;
+}
+
+int CpuInfo::node(int cpu) const {
+	return cpu >= 0 && cpu < (int)cpuNode.size() ? cpuNode[cpu] : 0;
+}
+
+std::vector< std::vector<int> > CpuInfo::byNode() const {
+	std::vector< std::vector<int> > nodes;
+	std::vector<int> nodeIds;
+	for (size_t i = 0; i < cpuIds.size(); i++) {
+		int n = node(cpuIds[i]);
+		size_t k = std::find(nodeIds.begin(), nodeIds.end(), n) - nodeIds.begin();
+		if (k == nodeIds.size()) {
+			nodeIds.push_back(n);
+			nodes.push_back(std::vector<int>());
+		}
+		nodes[k].push_back(cpuIds[i]);
+	}
+	return nodes;
+}
+
+int CpuInfo::defaultThreads(int maxPerNode) const {
+	if (maxPerNode <= 0)
+		return numAvailable;
+	std::vector< std::vector<int> > nodes = byNode();
+	int total = 0;
+	for (size_t k = 0; k < nodes.size(); k++)
+		total += std::min((int)nodes[k].size(), maxPerNode);
+	return std::max(1, std::min(numAvailable, total));
+}
+
+std::vector<int> CpuInfo::placement(int numThreads, int maxPerNode) const {
+	std::vector< std::vector<int> > nodes = byNode();
+
+	// take one CPU from each node in turn
+	std::vector<int> order;
+	for (size_t round = 0; ; round++) {
+		bool any = false;
+		for (size_t k = 0; k < nodes.size(); k++) {
+			if (round < nodes[k].size() && (maxPerNode <= 0 || (int)round < maxPerNode)) {
+				order.push_back(nodes[k][round]);
+				any = true;
+			}
+		}
+		if (!any)
+			break;
+	}
+
+	std::vector<int> cpus;
+	for (int i = 0; i < numThreads && !order.empty(); i++)
+		cpus.push_back(order[i % order.size()]);
+	return cpus;
+}
+
+bool CpuInfo::pin(std::thread& thread, int cpu) {
+#ifdef WIN32
+	if (cpu < 0 || cpu >= (int)(8 * sizeof(DWORD_PTR)))
+		return false;
+	return SetThreadAffinityMask(thread.native_handle(), (DWORD_PTR)1 << cpu) != 0;
+#elif defined(__linux__)
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+		return false;
+	cpu_set_t mask;
+	CPU_ZERO(&mask);
+	CPU_SET(cpu, &mask);
+	return pthread_setaffinity_np(thread.native_handle(), sizeof(mask), &mask) == 0;
+#else
+	return false;
+#endif
+}
@@ -0,0 +1,54 @@
+// CpuInfo.h
+// What CPUs the process may actually use, for picking a default number
+// of render threads and for pinning them.  On shared machines that is
+// often far fewer than std::thread::hardware_concurrency() reports: the
+// process can be restricted to some CPUs (taskset, cpusets) or given a
+// CPU time quota by its cgroup (containers, batch schedulers).
+
+#ifndef CPU_INFO_H
+#define CPU_INFO_H
+
+#include <thread>
+#include <vector>
+
+class CpuInfo
+{
+public:
+	// Probed once, the first time it is asked for.
+	static const CpuInfo& system();
+
+	// Number of CPUs worth of work the process can run at once: the CPUs
+	// in its affinity mask, further limited by any cgroup CPU quota.
+	int available() const { return numAvailable; }
+
+	// Ids of the CPUs in the affinity mask.
+	const std::vector<int>& cpus() const { return cpuIds; }
+
+	// NUMA node of a CPU; 0 when there is no NUMA information.
+	int node(int cpu) const;
+
+	// Default thread count: available(), and no more than maxPerNode on
+	// any NUMA node if maxPerNode > 0.
+	int defaultThreads(int maxPerNode) const;
+
+	// CPUs to pin numThreads workers to, one per worker.  Nodes are
+	// filled in turn so that workers spread over all of them, with at
+	// most maxPerNode workers per node if maxPerNode > 0.  CPUs are
+	// reused if there are more workers than that allows.
+	std::vector<int> placement(int numThreads, int maxPerNode) const;
+
+	// Pin a thread to one CPU.  Returns false where that isn't supported.
+	static bool pin(std::thread& thread, int cpu);
+
+private:
+	CpuInfo();
+
+	// CPU ids grouped by NUMA node, in the order of cpuIds
+	std::vector< std::vector<int> > byNode() const;
+
+	std::vector<int> cpuIds;
+	std::vector<int> cpuNode;	// indexed by CPU id
+	int numAvailable;
+};
+
+#endif
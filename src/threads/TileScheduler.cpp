@@ -0,0 +1,212 @@
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include "TileScheduler.h"
+
+const char* TileScheduler::orderName(Order order) {
+	switch (order) {
+	case ROW_MAJOR:	return "row";
+	case HILBERT:	return "hilbert";
+	case SPIRAL:	return "spiral";
+	default:		return "?";
+	}
+}
+
+// Cell d along the Hilbert curve through an n x n grid, n a power of 2.
+static void hilbertCell(int n, int d, int& x, int& y) {
+	x = y = 0;
+	for (int s = 1; s < n; s *= 2) {
+		int rx = 1 & (d / 2);
+		int ry = 1 & (d ^ rx);
+		if (ry == 0) {
+			if (rx == 1) {
+				x = s - 1 - x;
+				y = s - 1 - y;
+			}
+			std::swap(x, y);
+		}
+		x += s * rx;
+		y += s * ry;
+		d /= 4;
+	}
+}
+
+// Sort key for the spiral: ring first, then angle around the center.
+struct SpiralKey
+{
+	int ring;
+	double angle;
+	int tile;
+	bool operator<(const SpiralKey& k) const
+		{ return ring != k.ring ? ring < k.ring : angle < k.angle; }
+};
+
+TileScheduler::TileScheduler()
+	: next(0), busy(0), numPixelsDone(0), cancelled(false), queues(NULL), numWorkers(0),
+	  width(0), height(0), tileSize(1), tilesX(0), count(0)
+{
+}
+
+TileScheduler::~TileScheduler() {
+	delete [] queues;
+}
+
+void TileScheduler::reset(int w, int h, int size, int workers, Order o) {
+	if (size < 1)
+		size = 1;
+	bool sameTiles = w == width && h == height && size == tileSize && o == order;
+	width = w;
+	height = h;
+	tileSize = size;
+	order = o;
+	tilesX = (width + tileSize - 1) / tileSize;
+	int tilesY = (height + tileSize - 1) / tileSize;
+	count = tilesX * tilesY;
+	if (!sameTiles || (int)sequence.size() != count)
+		buildOrder(tilesY);
+
+	if (workers < 1)
+		workers = 1;
+	if (workers != numWorkers) {
+		delete [] queues;
+		queues = new WorkerQueue[workers];
+		numWorkers = workers;
+	}
+	for (int i = 0; i < numWorkers; i++) {
+		queues[i].tiles.clear();
+		queues[i].size.store(0);
+	}
+
+	next.store(0);
+	busy.store(numWorkers);
+	numPixelsDone.store(0);
+	cancelled.store(false);
+}
+
+void TileScheduler::buildOrder(int tilesY) {
+	sequence.clear();
+	sequence.reserve(count);
+
+	if (order == HILBERT) {
+		// Walk the curve through the smallest power of 2 square that
+		// covers the tiles, skipping the cells that fall off the image.
+		int n = 1;
+		while (n < tilesX || n < tilesY)
+			n *= 2;
+		for (int d = 0; d < n * n; d++) {
+			int x, y;
+			hilbertCell(n, d, x, y);
+			if (x < tilesX && y < tilesY)
+				sequence.push_back(y * tilesX + x);
+		}
+	} else if (order == SPIRAL) {
+		// Rings of tiles around the center, each one going round from
+		// the same angle.
+		std::vector<SpiralKey> keys(count);
+		double cx = 0.5 * width / tileSize, cy = 0.5 * height / tileSize;
+		for (int k = 0; k < count; k++) {
+			double dx = (k % tilesX) + 0.5 - cx, dy = (k / tilesX) + 0.5 - cy;
+			keys[k].ring = (int)std::max(fabs(dx), fabs(dy));
+			keys[k].angle = atan2(dy, dx);
+			keys[k].tile = k;
+		}
+		std::stable_sort(keys.begin(), keys.end());
+		for (int k = 0; k < count; k++)
+			sequence.push_back(keys[k].tile);
+	} else {
+		for (int k = 0; k < count; k++)
+			sequence.push_back(k);
+	}
+}
+
+bool TileScheduler::takeShared(Tile& t) {
+	if (next.load(std::memory_order_relaxed) >= count)
+		return false;
+	int k = next.fetch_add(1, std::memory_order_relaxed);
+	if (k >= count)
+		return false;
+	k = sequence[k];
+	t.x0 = (k % tilesX) * tileSize;
+	t.y0 = (k / tilesX) * tileSize;
+	t.x1 = t.x0 + tileSize < width ? t.x0 + tileSize : width;
+	t.y1 = t.y0 + tileSize < height ? t.y0 + tileSize : height;
+	return true;
+}
+
+bool TileScheduler::takeOwn(int worker, Tile& t) {
+	WorkerQueue& q = queues[worker];
+	if (q.size.load(std::memory_order_relaxed) == 0)
+		return false;
+	std::lock_guard<std::mutex> guard(q.lock);
+	if (q.tiles.empty())
+		return false;
+	t = q.tiles.back();
+	q.tiles.pop_back();
+	q.size.store((int)q.tiles.size(), std::memory_order_relaxed);
+	return true;
+}
+
+bool TileScheduler::steal(int worker, Tile& t) {
+	for (int i = 1; i < numWorkers; i++) {
+		WorkerQueue& q = queues[(worker + i) % numWorkers];
+		if (q.size.load(std::memory_order_relaxed) == 0)
+			continue;
+		std::lock_guard<std::mutex> guard(q.lock);
+		if (q.tiles.empty())
+			continue;
+		t = q.tiles.front();
+		q.tiles.pop_front();
+		q.size.store((int)q.tiles.size(), std::memory_order_relaxed);
+		return true;
+	}
+	return false;
+}
+
+bool TileScheduler::take(int worker, Tile& t) {
+	if (cancelled.load(std::memory_order_relaxed))
+		return false;
+	if (takeShared(t) || takeOwn(worker, t) || steal(worker, t))
+		return true;
+
+	// Out of work.  Only workers that are busy can give any away, and a
+	// worker always finds its own queue's work before it stops being
+	// busy, so once nobody is busy everything has been handed out.
+	busy.fetch_sub(1);
+	for (;;) {
+		if (steal(worker, t)) {
+			busy.fetch_add(1);
+			return true;
+		}
+		if (busy.load() == 0 || cancelled.load(std::memory_order_relaxed))
+			return false;
+		std::this_thread::yield();
+	}
+}
+
+void TileScheduler::split(int worker, Tile& t, int y) {
+	// Splitting is only worth it when somebody is waiting for work, which
+	// only happens once the shared tiles have run out.
+	if (busy.load(std::memory_order_relaxed) == numWorkers)
+		return;
+	int rows = t.y1 - y;
+	if (rows < 2 * MIN_SPLIT_ROWS)
+		return;
+
+	Tile rest = t;
+	rest.y0 = y + rows / 2;
+	t.y1 = rest.y0;
+
+	WorkerQueue& q = queues[worker];
+	std::lock_guard<std::mutex> guard(q.lock);
+	q.tiles.push_back(rest);
+	q.size.store((int)q.tiles.size(), std::memory_order_relaxed);
+}
+
+void TileScheduler::done(const Tile& t) {
+	numPixelsDone.fetch_add((long)(t.x1 - t.x0) * (t.y1 - t.y0), std::memory_order_relaxed);
+}
+
+double TileScheduler::progress() const {
+	long total = (long)width * height;
+	return total > 0 ? (double)pixelsDone() / total : 1.0;
+}
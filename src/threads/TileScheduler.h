@@ -0,0 +1,105 @@
+// TileScheduler.h
+// Shares the tiles of an image out between worker threads.
+//
+// Workers first take whole tiles off a shared atomic counter, in one of
+// a few orders (see Order).  Once those run out, a worker that is still in
+// the middle of a tile gives away the bottom half of the rows it has
+// left whenever another worker is idle, pushing them onto its own queue,
+// and idle workers steal from the other workers' queues.  So a tile that
+// turns out to be expensive (lots of reflection and refraction) gets
+// broken up and finished by everyone instead of holding up the end of
+// the frame.
+
+#ifndef TILE_SCHEDULER_H
+#define TILE_SCHEDULER_H
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+// Pixels [x0, x1) x [y0, y1).
+struct Tile
+{
+	int x0, y0, x1, y1;
+};
+
+class TileScheduler
+{
+public:
+	// The order whole tiles are handed out in.  Workers run side by side
+	// down the list, so the closer together consecutive tiles are, the
+	// more of the scene they have in cache between them.
+	enum Order
+	{
+		ROW_MAJOR,		// rows from the top left
+		HILBERT,		// along a Hilbert curve, so consecutive tiles touch
+		SPIRAL,			// rings outwards from the center, which usually has
+						// what the image is of
+		NUM_ORDERS
+	};
+	static const char* orderName(Order order);
+
+	TileScheduler();
+	~TileScheduler();
+
+	// Start handing out tiles of a width x height image to numWorkers
+	// workers.  Must not be called while workers are taking tiles.
+	void reset(int width, int height, int tileSize, int numWorkers, Order order = ROW_MAJOR);
+
+	// Get the next piece of work for worker; false once the whole image
+	// is done.  Waits (yielding) while other workers may still give
+	// work away.
+	bool take(int worker, Tile& t);
+
+	// Called by worker after finishing the rows of t above y.  If another
+	// worker is idle and enough rows are left, the bottom half of them is
+	// given away and t.y1 shrinks accordingly.
+	void split(int worker, Tile& t, int y);
+
+	// Called by worker when it has finished t.
+	void done(const Tile& t);
+
+	// Pixels finished so far, and as a fraction of the image.
+	long pixelsDone() const { return numPixelsDone.load(std::memory_order_relaxed); }
+	double progress() const;
+
+	// Stop handing out work; take() returns false from now on.
+	void cancel() { cancelled.store(true); }
+
+	// Rows a piece of work is never split below.
+	static const int MIN_SPLIT_ROWS = 2;
+
+private:
+	TileScheduler(const TileScheduler&);
+	TileScheduler& operator=(const TileScheduler&);
+
+	// Work given away by one worker.  The owner takes the most recently
+	// split (smallest) pieces from the back; thieves take the oldest
+	// (largest) from the front.
+	struct WorkerQueue
+	{
+		std::mutex lock;
+		std::deque<Tile> tiles;
+		std::atomic<int> size;		// read without the lock to skip empty queues
+		char pad[64];				// keep queues in separate cache lines
+		WorkerQueue() : size(0) { }
+	};
+
+	void buildOrder(int tilesY);
+	bool takeShared(Tile& t);
+	bool takeOwn(int worker, Tile& t);
+	bool steal(int worker, Tile& t);
+
+	std::atomic<int> next;			// next tile off the shared counter
+	std::atomic<int> busy;			// workers not looking for work
+	std::atomic<long> numPixelsDone;
+	std::atomic<bool> cancelled;
+	WorkerQueue* queues;
+	int numWorkers;
+	int width, height, tileSize, tilesX, count;
+	Order order;
+	std::vector<int> sequence;		// tile indices in the order they go out
+};
+
+#endif
@@ -0,0 +1,88 @@
+#include <chrono>
+#include "WorkerPool.h"
+#include "CpuInfo.h"
+
+WorkerPool::WorkerPool()
+	: func(NULL), arg(NULL), generation(0), running(0), quit(false)
+{
+}
+
+WorkerPool::~WorkerPool() {
+	wait(NO_TIMEOUT);
+	stopWorkers();
+}
+
+void WorkerPool::resize(int numWorkers, const std::vector<int>& cpus) {
+	if (numWorkers < 1)
+		numWorkers = 1;
+	if (numWorkers == size() && cpus == pinnedTo)
+		return;
+
+	wait(NO_TIMEOUT);
+	stopWorkers();
+
+	pinnedTo = cpus;
+	for (int i = 0; i < numWorkers; i++) {
+		workers.push_back(std::thread(&WorkerPool::workerLoop, this, i, generation));
+		if (i < (int)pinnedTo.size())
+			CpuInfo::pin(workers.back(), pinnedTo[i]);
+	}
+}
+
+void WorkerPool::stopWorkers() {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		quit = true;
+	}
+	jobReady.notify_all();
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+	workers.clear();
+	quit = false;
+}
+
+void WorkerPool::start(jobFunc f, void* a) {
+	if (workers.empty())
+		resize(1);
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		func = f;
+		arg = a;
+		running = (int)workers.size();
+		generation++;
+	}
+	jobReady.notify_all();
+}
+
+bool WorkerPool::wait(unsigned int millis) {
+	std::unique_lock<std::mutex> guard(lock);
+	if (millis == NO_TIMEOUT) {
+		jobDone.wait(guard, [this] { return running == 0; });
+		return true;
+	}
+	return jobDone.wait_for(guard, std::chrono::milliseconds(millis), [this] { return running == 0; });
+}
+
+// seen is the job generation when the worker was created; the worker
+// waits for the next one.
+void WorkerPool::workerLoop(int worker, unsigned long seen) {
+	for (;;) {
+		jobFunc f;
+		void* a;
+		{
+			std::unique_lock<std::mutex> guard(lock);
+			jobReady.wait(guard, [this, seen] { return quit || generation != seen; });
+			if (quit)
+				return;
+			seen = generation;
+			f = func;
+			a = arg;
+		}
+
+		f(worker, a);
+
+		std::lock_guard<std::mutex> guard(lock);
+		if (--running == 0)
+			jobDone.notify_all();
+	}
+}
@@ -0,0 +1,55 @@
+// WorkerPool.h
+// A set of worker threads that stay alive between jobs, so that
+// rendering a frame doesn't have to create and join threads.
+// Every worker runs the job function once per job; the job itself
+// decides how the work is shared out (see TileScheduler.h).
+
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class WorkerPool
+{
+public:
+	typedef void(*jobFunc)(int worker, void* arg);
+
+	WorkerPool();
+	~WorkerPool();
+
+	// Number of worker threads, optionally pinned to the given CPUs (one
+	// per worker, see CpuInfo::placement).  Changing either waits for the
+	// current job to finish first.
+	void resize(int numWorkers, const std::vector<int>& cpus = std::vector<int>());
+	int size() const { return (int)workers.size(); }
+
+	// Run func(worker, arg) on every worker and return straight away.
+	// A job must not be started while another one is still running.
+	void start(jobFunc func, void* arg);
+	// Wait up to millis for the current job; true once it is done.
+	bool wait(unsigned int millis);
+	static const unsigned int NO_TIMEOUT = (unsigned)(-1);
+
+private:
+	WorkerPool(const WorkerPool&);
+	WorkerPool& operator=(const WorkerPool&);
+
+	void workerLoop(int worker, unsigned long seen);
+	void stopWorkers();
+
+	std::vector<std::thread> workers;
+	std::vector<int> pinnedTo;
+	std::mutex lock;
+	std::condition_variable jobReady;	// signalled when a job is posted or on shutdown
+	std::condition_variable jobDone;	// signalled when the last worker finishes
+	jobFunc func;
+	void* arg;
+	unsigned long generation;			// bumped for every job
+	int running;						// workers still inside the current job
+	bool quit;
+};
+
+#endif
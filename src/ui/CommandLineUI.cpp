@@ -1,21 +1,39 @@
 #include <iostream>
 #include <time.h>
+#include <chrono>
 #include <stdarg.h>
+#include <csignal>
 #ifndef WIN32
 #include <unistd.h>
+#else
+#include <io.h>
+#define isatty _isatty
+#define STDERR_FILENO 2
 #endif
 
 #include <assert.h>
 #include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <vector>
 
 #include "CommandLineUI.h"
 #include "../fileio/imageio.h"
 
 #include "../RayTracer.h"
+#include "../RenderFarm.h"
+#include "../RenderServer.h"
+#include "../scene/hbv.h"
+#include "../scene/raystats.h"
 #include "../getopt.h"
 
 using namespace std;
 
+#ifdef MULTITHREADED
+// Set by the first ^C; the render loop turns it into a cancel.
+static volatile sig_atomic_t interrupted = 0;
+#endif
+
 // ***********************************************************
 
 
@@ -25,11 +43,16 @@ CommandLineUI::CommandLineUI( int argc, char** argv )
 	: TraceUI()
 {
 	int i;
-	num_threads = 10;
 
 	progName=argv[0];
+	rayName = imgName = NULL;
+#ifdef MULTITHREADED
+	m_bServe = false;
+	m_nProcesses = 0;
+	m_bBudget = false;
+#endif
 
-	while( (i = getopt( argc, argv, "r:w:t:bBaAh" )) != EOF )
+	while( (i = getopt( argc, argv, "r:w:k:t:pn:o:zZgT:R:e:x:DP:bBaAd:c:E:M:ms:l:h" )) != EOF )
 	{
 		switch( i )
 		{
@@ -40,16 +63,108 @@ CommandLineUI::CommandLineUI( int argc, char** argv )
 			case 'w':
 				m_nSize = atoi( optarg );
 				break;
+			case 'k':
+				m_dCutoff = atof( optarg );
+				break;
 			case 'b':
-				// TODO: Add code to ENABLE accelerated intersection testing!
+				m_BSPInfo = true;
 				break;
 			case 'B':
-				// TODO: Add code to DISABLE accelerated intersection testing!
+				m_BSPInfo = false;
+				break;
+			case 'a':
+				m_antiAliasInfo = true;
+				break;
+			case 'A':
+				m_antiAliasInfo = false;
+				break;
+			case 'd':
+				m_nAADepth = atoi( optarg );
+				break;
+			case 'c':
+				m_dAAContrast = atof( optarg );
+				break;
+			case 'E':
+				m_dExposure = atof( optarg );
+				break;
+			case 'M':
+			{
+				int k = 0;
+				while( k < RenderSettings::NUM_TONE_MAPS && strcmp( optarg, RenderSettings::toneMapName( (RenderSettings::ToneMap)k ) ) )
+					k++;
+				if( k == RenderSettings::NUM_TONE_MAPS )
+				{
+					std::cerr << "Unknown tone mapping '" << optarg << "'." << std::endl;
+					usage();
+					exit(1);
+				}
+				m_nToneMap = (RenderSettings::ToneMap)k;
+				break;
+			}
+			case 'm':
+				m_bSAHBuild = false;
+				break;
+			case 's':
+				m_nSAHBins = atoi( optarg );
+				break;
+			case 'l':
+				m_nLeafSize = atoi( optarg );
 				break;
 #ifdef MULTITHREADED
 			case 't':
 				num_threads = atoi( optarg );
 				break;
+			case 'p':
+				m_bPinThreads = true;
+				break;
+			case 'n':
+				m_nThreadsPerNode = atoi( optarg );
+				break;
+			case 'o':
+			{
+				int k = 0;
+				while( k < TileScheduler::NUM_ORDERS && strcmp( optarg, TileScheduler::orderName( (TileScheduler::Order)k ) ) )
+					k++;
+				if( k == TileScheduler::NUM_ORDERS )
+				{
+					std::cerr << "Unknown tile order '" << optarg << "'." << std::endl;
+					usage();
+					exit(1);
+				}
+				m_nTileOrder = (TileScheduler::Order)k;
+				break;
+			}
+			case 'z':
+				m_bMortonPixels = true;
+				break;
+			case 'Z':
+				m_bMortonPixels = false;
+				break;
+			case 'g':
+				m_bProgressive = true;
+				break;
+			case 'T':
+				m_budget.seconds = atof( optarg );
+				m_bBudget = true;
+				break;
+			case 'R':
+				m_budget.rays = strtoull( optarg, NULL, 10 );
+				m_bBudget = true;
+				break;
+			case 'e':
+				m_budget.targetError = atof( optarg );
+				m_bBudget = true;
+				break;
+			case 'x':
+				m_budget.maxSamples = atoi( optarg );
+				m_bBudget = true;
+				break;
+			case 'D':
+				m_bServe = true;
+				break;
+			case 'P':
+				m_nProcesses = atoi( optarg );
+				break;
 #endif
 			case 'h':
 				usage();
@@ -64,6 +179,20 @@ CommandLineUI::CommandLineUI( int argc, char** argv )
 		}
 	}
 
+#ifdef MULTITHREADED
+	// The workers each render whole bands in one go, so they can't
+	// do budgets or progressive passes
+	if( m_nProcesses > 0 && ( m_bBudget || m_bProgressive ) )
+	{
+		std::cerr << "-P can't be used with -T, -R, -e, -x or -g." << std::endl;
+		usage();
+		exit(1);
+	}
+
+	if( m_bServe )
+		return;
+#endif
+
 	if( optind >= argc-1 )
 	{
 		std::cerr << "no input and/or output name." << std::endl;
@@ -82,35 +211,102 @@ CommandLineUI::CommandLineUI( int argc, char** argv )
 
 int CommandLineUI::run()
 {
+#ifdef MULTITHREADED
+	if( m_bServe )
+		return serve();
+#endif
+
 	assert( raytracer != 0 );
-	raytracer->loadScene( rayName );
+	std::chrono::steady_clock::time_point loadStart = std::chrono::steady_clock::now();
+	if( !raytracer->loadScene( rayName, getBuildOptions() ) )
+		alert( raytracer->getError() );
+	std::chrono::duration<double> loadTime = std::chrono::steady_clock::now() - loadStart;
 
 	if( raytracer->sceneLoaded() )
 	{
+		const HBV* hbv = raytracer->getScene().getHBV();
+		if( hbv )
+		{
+			std::cout << "bvh: ";
+			if( hbv->buildOptions().method == HBVBuildOptions::SAH )
+				std::cout << "sah (" << hbv->buildOptions().sahBins << " bins, leaf size " 
+					<< hbv->buildOptions().maxLeafSize << ")";
+			else
+				std::cout << "midpoint";
+			std::cout << ", " << hbv->nodes() << " nodes, " << hbv->leaves() << " leaves, depth " 
+				<< hbv->depth() << ", sah cost = " 
+				<< hbv->sahCost() << std::endl;
+		}
+		std::cout << "load time = " << loadTime.count() << " seconds" << std::endl;
+
 		width = m_nSize;
 		height = (int)(width / raytracer->aspectRatio() + 0.5);
 
-		raytracer->traceSetup( width, height );
+		raytracer->traceSetup( width, height, getRenderSettings() );
 
 		clock_t start, end;
+		RayStats::reset();
 		start = clock();
 
 #ifdef MULTITHREADED
-		nextX = 0;
-		nextY = 0;
-		
-		setMultithreading(true);
-		ThreadPool* tp = new ThreadPool();
-		for (int i = 0; i < num_threads; i++)
-			tp->startThread(threadStart, this);
-		tp->waitForThreads(ThreadPool::NO_TIMEOUT);
-		setMultithreading(false);
-		delete tp;
+		if( m_nProcesses > 0 )
+		{
+			if( !renderOnProcesses() )
+				return 1;
+		}
+		else if( m_bBudget )
+		{
+			if( !renderToBudget() )
+				return 1;
+		}
+		else
+		{
+			setupWorkers();
+			std::cout << "render threads = " << workers.size() << (m_bPinThreads ? " (pinned)" : "") 
+				<< ", tile order = " << TileScheduler::orderName( m_nTileOrder ) 
+				<< (m_bMortonPixels ? " (morton pixels)" : "") 
+				<< (m_bProgressive ? ", progressive" : "") << std::endl;
+			
+			// Show progress only on a terminal, so logs don't fill up with it
+			bool showProgress = isatty(STDERR_FILENO) != 0;
+			interrupted = 0;
+			void (*oldHandler)(int) = signal(SIGINT, onInterrupt);
+
+			job.start(raytracer, workers, width, height);
+			while (!job.wait(500))
+			{
+				if (interrupted)
+					job.cancel();
+				if (showProgress)
+				{
+					fprintf(stderr, "\r(%d%%) %llu rays", (int)(job.progress() * 100.0), job.raysTraced());
+					double left = job.remaining();
+					if (left >= 0)
+						fprintf(stderr, ", %.0f seconds left", left);
+					fprintf(stderr, "    ");
+				}
+			}
+			if (showProgress)
+				fprintf(stderr, "\r%60s\r", "");
+			signal(SIGINT, oldHandler);
+
+			if (job.cancelled() && job.pixelsDone() < job.pixels())
+			{
+				if (job.passesDone() == 0)
+				{
+					std::cerr << "render cancelled at " << (int)(job.progress() * 100.0) << "%, after " 
+						<< job.elapsed() << " seconds" << std::endl;
+					return 1;
+				}
+				// A progressive render has a whole image after its first pass
+				std::cerr << "render stopped at " << (int)(job.progress() * 100.0) << "%, after " 
+					<< job.passesDone() << " of " << job.passes() << " passes; saving it as it is" << std::endl;
+			}
+		}
 #else
 		for( int j = 0; j < height; ++j )
 		for( int i = 0; i < width; ++i )
-			raytracer->ptrTracePixel(i,j);
-				//raytracer->tracePixel(i,j);
+			raytracer->renderPixel(i,j);
 #endif
 
 		end=clock();
@@ -124,6 +320,21 @@ int CommandLineUI::run()
 			save(imgName, buf, width, height, ".png", 95);
 
 		double t=(double)(end-start)/CLOCKS_PER_SEC;
+#ifdef MULTITHREADED
+		// renderOnProcesses() has had its say; these rays were all elsewhere
+		if( m_nProcesses == 0 )
+		{
+#endif
+		RayCounts counts = RayStats::total();
+		std::cout << "rays = " << counts.total() << " (" << counts.rays[ray::VISIBILITY] << " visibility, "
+			<< counts.rays[ray::REFLECTION] << " reflection, " << counts.rays[ray::REFRACTION] << " refraction, "
+			<< counts.rays[ray::SHADOW] << " shadow), " << counts.hits << " hits" << std::endl;
+#ifdef MULTITHREADED
+		// and renderToBudget() has told of its several jobs
+		if( !m_bBudget )
+			std::cout << "render time = " << job.elapsed() << " seconds (wall clock)" << std::endl;
+		}
+#endif
 		std::cout << "total time = " << t << " seconds" << std::endl;
         return 0;
 	}
@@ -142,57 +353,164 @@ void CommandLineUI::alert( const string& msg )
 void CommandLineUI::usage()
 {
 	std::cerr << "usage: " << progName << " [options] [input.ray output.bmp]" << std::endl;
+#ifdef MULTITHREADED
+	std::cerr << "       " << progName << " [options] -D" << std::endl;
+#endif
 	std::cerr << "  -r <#>      set recursion level (default " << m_nDepth << ")" << std::endl; 
 	std::cerr << "  -w <#>      set output image width (default " << m_nSize << ")" << std::endl;
-	std::cerr << "  -b          (TODO) enable accelerated intersection testing (default)" << std::endl;
-	std::cerr << "  -B          (TODO) disable accelerated intersection testing" << std::endl;
-	std::cerr << "  -a          (TODO) enable antialiasing" << std::endl;
-	std::cerr << "  -A          (TODO) disable antialiasing (default)" << std::endl;
+	std::cerr << "  -k <#>      don't reflect or refract rays that would count for less than" << std::endl;
+	std::cerr << "              this in the pixel (default " << m_dCutoff << ", 0 to follow them all)" << std::endl;
+	std::cerr << "  -b          enable accelerated intersection testing (default)" << std::endl;
+	std::cerr << "  -B          disable accelerated intersection testing, testing every" << std::endl;
+	std::cerr << "              ray against every object" << std::endl;
+	std::cerr << "  -a          enable antialiasing" << std::endl;
+	std::cerr << "  -A          disable antialiasing (default)" << std::endl;
+	std::cerr << "  -d <#>      split antialiased pixels up to this many times where they" << std::endl;
+	std::cerr << "              need it (default " << m_nAADepth << "), or 0 to sample a 3x3 grid" << std::endl;
+	std::cerr << "  -c <#>      colour difference (0-1) that makes antialiasing split a" << std::endl;
+	std::cerr << "              pixel (default " << m_dAAContrast << ")" << std::endl;
+	std::cerr << "  -E <#>      scale colours by this before tone mapping (default " << m_dExposure << ")" << std::endl;
+	std::cerr << "  -M <op>     tone mapping: clamp or reinhard (default "
+		<< RenderSettings::toneMapName( m_nToneMap ) << ")" << std::endl;
+	std::cerr << "  -m          build the bvh with the midpoint splitter instead of sah" << std::endl;
+	std::cerr << "  -s <#>      set number of sah bins per axis (default " << m_nSAHBins << ")" << std::endl;
+	std::cerr << "  -l <#>      set max primitives per sah leaf (default " << m_nLeafSize << ")" << std::endl;
 #ifdef MULTITHREADED
-	std::cerr << "  -t			number of threads (default 10)" << std::endl;
+	std::cerr << "  -t <#>      number of threads (default " << getThreads() << ", from the available cpus)" << std::endl;
+	std::cerr << "  -p          pin each thread to its own cpu" << std::endl;
+	std::cerr << "  -n <#>      at most this many threads per numa node (default no limit)" << std::endl;
+	std::cerr << "  -o <order>  order to render tiles in: row, hilbert or spiral (default " 
+		<< TileScheduler::orderName( m_nTileOrder ) << ")" << std::endl;
+	std::cerr << "  -z          visit the pixels in a tile in morton order (default)" << std::endl;
+	std::cerr << "  -Z          visit the pixels in a tile a row at a time" << std::endl;
+	std::cerr << "  -g          render progressively, coarse to fine, so that ^C after the" << std::endl;
+	std::cerr << "              first pass still saves a whole (if blocky) image" << std::endl;
+	std::cerr << "  -D          keep running, rendering requests read from stdin, with the" << std::endl;
+	std::cerr << "              options above as defaults (see RenderServer.h)" << std::endl;
+	std::cerr << "  -T <#>      render for this many seconds (wall clock), putting extra" << std::endl;
+	std::cerr << "              samples where pixels are noisiest, instead of antialiasing" << std::endl;
+	std::cerr << "  -R <#>      the same, but for this many rays; with -T, whichever runs out first" << std::endl;
+	std::cerr << "  -e <#>      the same, but until every pixel's error is below this" << std::endl;
+	std::cerr << "  -x <#>      at most this many samples per pixel for -T, -R or -e (default " 
+		<< m_budget.maxSamples << ")" << std::endl;
+	std::cerr << "  -P <#>      render on this many worker processes, splitting -t threads" << std::endl;
+	std::cerr << "              between them (default 0, render in this process); not with" << std::endl;
+	std::cerr << "              -T, -R, -e, -x or -g" << std::endl;
 #endif
 	std::cerr << "  -h          display this help message" << std::endl;
 }
 
 #ifdef MULTITHREADED
-void CommandLineUI::threadStart(ThreadPool* tp, void* arg) {
-	CommandLineUI* pUI = (CommandLineUI*)arg;
-	tp->holdMutex();
-	int x = pUI->nextX;
-	int y = pUI->nextY;
-	while ( y < pUI->height) 
+int CommandLineUI::serve()
+{
+	setupWorkers();
+	std::cerr << progName << ": serving render requests on stdin, " << workers.size() << " render threads" << std::endl;
+
+	RenderServer server( workers, job, getBuildOptions(), getRenderSettings(), m_nSize );
+	server.serve( std::cin, std::cout );
+	return 0;
+}
+
+// Render the frame set up in raytracer on m_nProcesses copies of this
+// program, straight into its buffer.
+bool CommandLineUI::renderOnProcesses()
+{
+	// The workers get this process's settings; their threads come out of
+	// its share rather than each taking the whole machine.
+	int threads = getThreads() / m_nProcesses;
+	std::vector<std::string> args;
+	std::ostringstream n;
+	n << ( threads > 1 ? threads : 1 );
+	args.push_back( "-t" );
+	args.push_back( n.str() );
+	args.push_back( "-o" );
+	args.push_back( TileScheduler::orderName( m_nTileOrder ) );
+	args.push_back( m_bMortonPixels ? "-z" : "-Z" );
+	if( !m_bSAHBuild )
+		args.push_back( "-m" );
+	n.str( "" );
+	n << m_nSAHBins;
+	args.push_back( "-s" );
+	args.push_back( n.str() );
+	n.str( "" );
+	n << m_nLeafSize;
+	args.push_back( "-l" );
+	args.push_back( n.str() );
+
+	RenderFarm farm;
+	if( !farm.start( progName, args, m_nProcesses ) )
 	{
-		int maxX = x + THREAD_CHUNKSIZE;
-		int maxY = min(y + THREAD_CHUNKSIZE,pUI->height);
-		if ( maxX >= pUI->width )
-		{
-			maxX = pUI->width;
-			pUI->nextX = 0;
-			pUI->nextY = min(maxY,pUI->height);
-		}
-		else
-		{
-			pUI->nextX = maxX;
-			pUI->nextY = y;
-		}
-		
-		
-		tp->releaseMutex();
-		for( int yy = y; yy < maxY;yy++)
-		{
-			for( int xx = x; xx < maxX ;xx++)
-			{
-				if (pUI->m_antiAliasInfo)	pUI->raytracer->tracePixelAntiAlias(xx, yy);
-				else  pUI->raytracer->tracePixel(xx, yy);
-				//pUI->raytracer->ptrTracePixel(xx, yy);
-				//pUI->raytracer->tracePixelAntiAlias(xx, yy);
-			}
-		}
-		tp->holdMutex();
-		x = pUI->nextX;
-		y = pUI->nextY;
+		alert( farm.getError() );
+		return false;
+	}
+	std::cout << "render processes = " << farm.size() << ", " << ( threads > 1 ? threads : 1 )
+		<< " threads each" << std::endl;
+
+	unsigned char* buf;
+	raytracer->getBuffer( buf, width, height );
+	std::chrono::steady_clock::time_point renderStart = std::chrono::steady_clock::now();
+	bool ok = farm.render( rayName, width, height, getRenderSettings(), buf );
+	std::chrono::duration<double> renderTime = std::chrono::steady_clock::now() - renderStart;
+	if( !ok )
+	{
+		alert( farm.getError() );
+		return false;
 	}
-	tp->releaseMutex();
 
+	std::cout << "rays = " << farm.raysTraced() << " (by the workers), " << farm.retries() 
+		<< " bands rendered again" << std::endl;
+	std::cout << "render time = " << renderTime.count() << " seconds (wall clock)" << std::endl;
+	return true;
+}
+
+// Render the frame to m_budget, showing how it goes.
+bool CommandLineUI::renderToBudget()
+{
+	setupWorkers();
+	std::cout << "render threads = " << workers.size() << (m_bPinThreads ? " (pinned)" : "") 
+		<< ", tile order = " << TileScheduler::orderName( m_nTileOrder ) 
+		<< (m_bMortonPixels ? " (morton pixels)" : "") << std::endl;
+	std::cout << "budget = ";
+	if( m_budget.seconds > 0 )
+		std::cout << m_budget.seconds << " seconds, ";
+	if( m_budget.rays > 0 )
+		std::cout << m_budget.rays << " rays, ";
+	if( m_budget.targetError > 0 )
+		std::cout << "error " << m_budget.targetError << ", ";
+	std::cout << "at most " << m_budget.maxSamples << " samples per pixel" << std::endl;
+
+	interrupted = 0;
+	void (*oldHandler)(int) = signal(SIGINT, onInterrupt);
+	BudgetedRender budgeted( workers, job );
+	BudgetedRender::Outcome outcome = budgeted.render( raytracer, width, height, getRenderSettings(), 
+		m_budget, onBudgetPoll, this );
+	if( isatty(STDERR_FILENO) )
+		fprintf(stderr, "\r%60s\r", "");
+	signal(SIGINT, oldHandler);
+
+	if( !budgeted.whole() )
+		std::cerr << "warning: the budget ran out before every pixel was traced once" << std::endl;
+	std::cout << "samples per pixel = " << budgeted.samplesPerPixel() << " (" << budgeted.minSamples() 
+		<< " to " << budgeted.maxSamples() << "), worst pixel error = " << budgeted.worstError() 
+		<< ", " << budgeted.rounds() << " rounds, " << BudgetedRender::outcomeName( outcome ) << std::endl;
+	std::cout << "render time = " << budgeted.elapsed() << " seconds (wall clock)" << std::endl;
+	return true;
+}
+
+bool CommandLineUI::onBudgetPoll(BudgetedRender* render, void* arg)
+{
+	static double lastShown = 0;
+	if( isatty(STDERR_FILENO) && render->elapsed() - lastShown >= 0.5 )
+	{
+		lastShown = render->elapsed();
+		fprintf(stderr, "\r%.0f seconds, %llu rays, round %d    ", lastShown, render->raysTraced(), render->rounds());
+	}
+	return !interrupted;
+}
+
+void CommandLineUI::onInterrupt(int sig) {
+	// A second ^C kills the program as usual.
+	interrupted = 1;
+	signal(sig, SIG_DFL);
 }
 #endif
@@ -8,9 +8,8 @@
 #define __CommandLineUI_h__
 
 #include "TraceUI.h"
-
 #ifdef MULTITHREADED
-#include "../threads/ThreadPool.h"
+#include "../BudgetedRender.h"
 #endif
 
 class CommandLineUI 
@@ -30,7 +29,17 @@ private:
 	char*	progName;
 
 #ifdef MULTITHREADED
-	static void threadStart(ThreadPool* tp, void* arg);
+	bool	m_bServe;		// answer render requests on stdin instead (see RenderServer.h)
+	int		m_nProcesses;	// render on this many worker processes, if > 0 (see RenderFarm.h)
+	bool	m_bBudget;		// render to m_budget instead (see BudgetedRender.h)
+	BudgetedRender::Budget m_budget;
+	int		serve();
+	bool	renderOnProcesses();
+	bool	renderToBudget();
+
+	static bool onBudgetPoll(BudgetedRender* render, void* arg);
+
+	static void onInterrupt(int sig);
 #endif
 };
 
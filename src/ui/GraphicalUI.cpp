@@ -20,8 +20,10 @@
 #pragma warning (disable: 4996)
 
 
+#ifndef MULTITHREADED
 bool GraphicalUI::stopTrace = false;
 bool GraphicalUI::doneTrace = true;
+#endif
 
 //------------------------------------- Help Functions --------------------------------------------
 GraphicalUI* GraphicalUI::whoami(Fl_Menu_* o)	// from menu item back to UI itself
@@ -63,8 +65,8 @@ const char* GraphicalUI::fileDialog(Fl_Native_File_Chooser::Type dialogType, con
 //--------------------------------- Callback Functions --------------------------------------------
 void GraphicalUI::cb_load_scene(Fl_Menu_* o, void* v) 
 {
-	stopTrace = true;
 	GraphicalUI* pUI=whoami(o);
+	pUI->stopTracing();	// terminate the previous rendering
 	
 	
 	static char* lastFile = 0;
@@ -76,10 +78,10 @@ void GraphicalUI::cb_load_scene(Fl_Menu_* o, void* v)
 
 	char buf[300];
 
-	if (pUI->raytracer->loadScene(newfile)) {
+	if (pUI->raytracer->loadScene(newfile, pUI->getBuildOptions())) {
 		sprintf(buf, "Ray <%s>", newfile);
-		stopTracing();	// terminate the previous rendering
 	} else{
+		pUI->alert(pUI->raytracer->getError());
 		sprintf(buf, "Ray <Not Loaded>");
 	}
 
@@ -130,7 +132,7 @@ void GraphicalUI::cb_exit(Fl_Menu_* o, void* v)
 	GraphicalUI* pUI=whoami(o);
 
 	// terminate the rendering
-	stopTracing();
+	pUI->stopTracing();
 
 	pUI->m_traceGlWindow->hide();
 	pUI->m_mainWindow->hide();
@@ -142,7 +144,7 @@ void GraphicalUI::cb_exit2(Fl_Widget* o, void* v)
 	GraphicalUI* pUI=(GraphicalUI *)(o->user_data());
 	
 	// terminate the rendering
-	stopTracing();
+	pUI->stopTracing();
 
 	pUI->m_traceGlWindow->hide();
 	pUI->m_mainWindow->hide();
@@ -159,7 +161,7 @@ void GraphicalUI::cb_sizeSlides(Fl_Widget* o, void* v)
 	GraphicalUI* pUI=(GraphicalUI*)(o->user_data());
 
 	// terminate the rendering so we don't get crashes
-	stopTracing();
+	pUI->stopTracing();
 
 	pUI->m_nSize=int( ((Fl_Slider *)o)->value() ) ;
 	int	height = (int)(pUI->m_nSize / pUI->raytracer->aspectRatio() + 0.5);
@@ -173,11 +175,59 @@ void GraphicalUI::cb_depthSlides(Fl_Widget* o, void* v)
 	((GraphicalUI*)(o->user_data()))->m_nDepth=int( ((Fl_Slider *)o)->value() ) ;
 }
 
+void GraphicalUI::cb_cutoffSlides(Fl_Widget* o, void* v)
+{
+	((GraphicalUI*)(o->user_data()))->m_dCutoff=((Fl_Slider *)o)->value();
+}
+
+void GraphicalUI::cb_aaDepthSlides(Fl_Widget* o, void* v)
+{
+	((GraphicalUI*)(o->user_data()))->m_nAADepth=int( ((Fl_Slider *)o)->value() ) ;
+}
+
+void GraphicalUI::cb_aaContrastSlides(Fl_Widget* o, void* v)
+{
+	((GraphicalUI*)(o->user_data()))->m_dAAContrast=((Fl_Slider *)o)->value();
+}
+
+void GraphicalUI::cb_exposureSlides(Fl_Widget* o, void* v)
+{
+	GraphicalUI* pUI = (GraphicalUI*)(o->user_data());
+	pUI->m_dExposure = ((Fl_Slider *)o)->value();
+
+	// A finished frame is tone mapped again straight away; one still
+	// rendering gets the new exposure next time
+#ifdef MULTITHREADED
+	bool rendering = pUI->job.running();
+#else
+	bool rendering = !doneTrace;
+#endif
+	if (pUI->raytracer->isReady() && !rendering) {
+		pUI->raytracer->toneMap(pUI->m_nToneMap, pUI->m_dExposure);
+		pUI->m_traceGlWindow->refresh();
+	}
+}
+
 #ifdef MULTITHREADED
 void GraphicalUI::cb_threadSlides(Fl_Widget* o, void* v)
 {
 	((GraphicalUI*)(o->user_data()))->num_threads=int( ((Fl_Slider *)o)->value() ) ;
 }
+
+void GraphicalUI::cb_tileOrderChoice(Fl_Widget* o, void* v)
+{
+	((GraphicalUI*)(o->user_data()))->m_nTileOrder = (TileScheduler::Order)((Fl_Choice*)o)->value();
+}
+
+void GraphicalUI::cb_mortonCheckButton(Fl_Widget* o, void* v)
+{
+	((GraphicalUI*)(o->user_data()))->m_bMortonPixels = (((Fl_Check_Button*)o)->value() == 1);
+}
+
+void GraphicalUI::cb_progressiveCheckButton(Fl_Widget* o, void* v)
+{
+	((GraphicalUI*)(o->user_data()))->m_bProgressive = (((Fl_Check_Button*)o)->value() == 1);
+}
 #endif
 
 void GraphicalUI::cb_debuggingDisplayCheckButton(Fl_Widget* o, void* v)
@@ -194,7 +244,6 @@ void GraphicalUI::cb_antiAliasCheckButton(Fl_Widget* o, void* v)
 {
 	GraphicalUI* pUI = (GraphicalUI*)(o->user_data());
 	pUI->m_antiAliasInfo = (((Fl_Check_Button*)o)->value() == 1);
-	pUI->raytracer->Antialias = (((Fl_Check_Button*)o)->value() == 1);
 	//pUI->raytracer->set_cb_tracer(&pUI->raytracer->tracePixelAntiAlias);
 }
 
@@ -218,7 +267,7 @@ void GraphicalUI::cb_render(Fl_Widget* o, void* v)
 
 		pUI->m_traceGlWindow->show();
 
-		pUI->raytracer->traceSetup(pUI->width, pUI->height);
+		pUI->raytracer->traceSetup(pUI->width, pUI->height, pUI->getRenderSettings());
 		
 		// Save the window label
 		const char *old_label = pUI->m_traceGlWindow->label();
@@ -232,33 +281,33 @@ void GraphicalUI::cb_render(Fl_Widget* o, void* v)
 		Fl::check();
 		Fl::flush();
 
-		doneTrace = false;
-		stopTrace = false;
 #ifdef MULTITHREADED
-		pUI->nextX = 0;
-		pUI->nextY = 0;
+		pUI->setupWorkers();
 		
-		pUI->setMultithreading(true);
-		ThreadPool* tp = new ThreadPool();
-		for (int i = 0; i < pUI->num_threads; i++)
-			tp->startThread(threadStart, pUI);
+		pUI->job.start(pUI->raytracer, pUI->workers, pUI->width, pUI->height, renderDone, pUI);
 		
-		while (!tp->waitForThreads(500)) {
+		// A progressive render has something to show almost at once
+		while (!pUI->job.wait(pUI->m_bProgressive ? 100 : 500)) {
 
 			pUI->updateRender();
+			pUI->m_debuggingWindow->m_debuggingView->setDirty();
 
-			sprintf(buffer, "(%d%%) %s", (int)((double)pUI->nextY / (double)pUI->height * 100.0), old_label);
+			double left = pUI->job.remaining();
+			if (left >= 0)
+				sprintf(buffer, "(%d%%, %.0fs left) %s", (int)(pUI->job.progress() * 100.0), left, old_label);
+			else
+				sprintf(buffer, "(%d%%) %s", (int)(pUI->job.progress() * 100.0), old_label);
 			pUI->m_traceGlWindow->label(buffer);
 		}
-
-		pUI->setMultithreading(false);
-		delete tp;
+		pUI->m_debuggingWindow->m_debuggingView->setDirty();
 #else
+		doneTrace = false;
+		stopTrace = false;
+
 		// start to render here	
 		clock_t prev, now;
 		prev=clock();
 
-		pUI->setMultithreading(false);
 		for (int y=0; y<pUI->height; y++) {
 			for (int x=0; x<pUI->width; x++) {
 				if (stopTrace) break;
@@ -272,7 +321,7 @@ void GraphicalUI::cb_render(Fl_Widget* o, void* v)
 					pUI->updateRender();
 				}
 
-				pUI->raytracer->tracePixelAntiAlias( x, y );
+				pUI->raytracer->renderPixel( x, y );
 				//pUI->raytracer->ptrTracePixel(x,y);
 				pUI->m_debuggingWindow->m_debuggingView->setDirty();
 			}
@@ -285,9 +334,9 @@ void GraphicalUI::cb_render(Fl_Widget* o, void* v)
 			pUI->m_traceGlWindow->label(buffer);
 			
 		}
-#endif
 		doneTrace=true;
 		stopTrace=false;
+#endif
 
 		pUI->m_traceGlWindow->refresh();
 
@@ -298,7 +347,11 @@ void GraphicalUI::cb_render(Fl_Widget* o, void* v)
 
 void GraphicalUI::cb_stop(Fl_Widget* o, void* v)
 {
+#ifdef MULTITHREADED
+	((GraphicalUI*)(o->user_data()))->job.cancel();
+#else
 	stopTrace = true;
+#endif
 }
 
 int GraphicalUI::run()
@@ -340,18 +393,32 @@ Fl_Menu_Item GraphicalUI::menuitems[] = {
 
 void GraphicalUI::stopTracing()
 {
+#ifdef MULTITHREADED
+	job.cancel();
+
+	// Wait for the workers to let go of the frame; renderDone wakes us up,
+	// and the timeout makes sure a missed wakeup can't leave us stuck
+	while( job.running() )	Fl::wait( 0.05 );
+#else
 	if( stopTrace ) return;			// Only one person can be waiting at a time
 
 	stopTrace = true;
 
 	// Wait for the trace to finish (simple synchronization)
 	while( !doneTrace )	Fl::wait();
+#endif
 }
 
 GraphicalUI::GraphicalUI() : m_nativeChooser(NULL) {
 	// init.
 
-	m_mainWindow = new Fl_Window(100, 40, 350, 310, "Ray <Not Loaded>");
+#ifdef MULTITHREADED
+	// Sets up the pipe Fl::awake() writes to, without which renderDone()
+	// can't wake the main thread; must happen before any worker runs
+	Fl::lock();
+#endif
+
+	m_mainWindow = new Fl_Window(100, 40, 350, 365, "Ray <Not Loaded>");
 		m_mainWindow->user_data((void*)(this));	// record self to be used by static callback functions
 		// install menu bar
 		m_menubar = new Fl_Menu_Bar(0, 0, 320, 25);
@@ -390,14 +457,62 @@ GraphicalUI::GraphicalUI() : m_nativeChooser(NULL) {
 		m_threadSlider->labelfont(FL_COURIER);
 		m_threadSlider->labelsize(12);
 		m_threadSlider->minimum(1);
-		m_threadSlider->maximum(40);
+		num_threads = getThreads();
+		m_threadSlider->maximum(num_threads > 40 ? num_threads : 40);
 		m_threadSlider->step(1);
-		m_threadSlider->value(4);
+		m_threadSlider->value(num_threads);
 		m_threadSlider->align(FL_ALIGN_RIGHT);
 		m_threadSlider->callback(cb_threadSlides);
-		num_threads = 4;
+
+		// set up tile order choice, listed in TileScheduler::Order order
+		m_tileOrderChoice = new Fl_Choice(10, 105, 100, 20, "Tile order");
+		m_tileOrderChoice->user_data((void*)(this));
+		m_tileOrderChoice->labelfont(FL_COURIER);
+		m_tileOrderChoice->labelsize(12);
+		for (int k = 0; k < TileScheduler::NUM_ORDERS; k++)
+			m_tileOrderChoice->add(TileScheduler::orderName((TileScheduler::Order)k));
+		m_tileOrderChoice->value((int)m_nTileOrder);
+		m_tileOrderChoice->align(FL_ALIGN_RIGHT);
+		m_tileOrderChoice->callback(cb_tileOrderChoice);
+
+		// set up morton pixel order checkbox
+		m_mortonCheckButton = new Fl_Check_Button(0, 190, 180, 20, "Morton Pixel Order");
+		m_mortonCheckButton->user_data((void*)(this));
+		m_mortonCheckButton->callback(cb_mortonCheckButton);
+		m_mortonCheckButton->value(m_bMortonPixels);
+
+		// set up progressive render checkbox
+		m_progressiveCheckButton = new Fl_Check_Button(180, 190, 170, 20, "Progressive");
+		m_progressiveCheckButton->user_data((void*)(this));
+		m_progressiveCheckButton->callback(cb_progressiveCheckButton);
+		m_progressiveCheckButton->value(m_bProgressive);
 #endif
 
+		// install antialiasing sliders; a depth of 0 means a fixed 3x3 grid
+		m_aaDepthSlider = new Fl_Value_Slider(10, 130, 180, 20, "AA depth");
+		m_aaDepthSlider->user_data((void*)(this));
+		m_aaDepthSlider->type(FL_HOR_NICE_SLIDER);
+		m_aaDepthSlider->labelfont(FL_COURIER);
+		m_aaDepthSlider->labelsize(12);
+		m_aaDepthSlider->minimum(0);
+		m_aaDepthSlider->maximum(5);
+		m_aaDepthSlider->step(1);
+		m_aaDepthSlider->value(m_nAADepth);
+		m_aaDepthSlider->align(FL_ALIGN_RIGHT);
+		m_aaDepthSlider->callback(cb_aaDepthSlides);
+
+		m_aaContrastSlider = new Fl_Value_Slider(10, 155, 180, 20, "AA contrast");
+		m_aaContrastSlider->user_data((void*)(this));
+		m_aaContrastSlider->type(FL_HOR_NICE_SLIDER);
+		m_aaContrastSlider->labelfont(FL_COURIER);
+		m_aaContrastSlider->labelsize(12);
+		m_aaContrastSlider->minimum(0);
+		m_aaContrastSlider->maximum(1);
+		m_aaContrastSlider->step(0.01);
+		m_aaContrastSlider->value(m_dAAContrast);
+		m_aaContrastSlider->align(FL_ALIGN_RIGHT);
+		m_aaContrastSlider->callback(cb_aaContrastSlides);
+
 		// set up antialias checkbox
 		m_antiAliasCheckButton = new Fl_Check_Button(0, 220, 180, 20, "Antialias Enabled");
 		m_antiAliasCheckButton->user_data((void*)(this));
@@ -417,6 +532,32 @@ GraphicalUI::GraphicalUI() : m_nativeChooser(NULL) {
 		m_debuggingDisplayCheckButton->callback(cb_debuggingDisplayCheckButton);
 		m_debuggingDisplayCheckButton->value(m_displayDebuggingInfo);
 
+		// install ray cutoff slider
+		m_cutoffSlider = new Fl_Value_Slider(10, 310, 180, 20, "Ray cutoff");
+		m_cutoffSlider->user_data((void*)(this));
+		m_cutoffSlider->type(FL_HOR_NICE_SLIDER);
+		m_cutoffSlider->labelfont(FL_COURIER);
+		m_cutoffSlider->labelsize(12);
+		m_cutoffSlider->minimum(0);
+		m_cutoffSlider->maximum(0.05);
+		m_cutoffSlider->step(0.001);
+		m_cutoffSlider->value(m_dCutoff);
+		m_cutoffSlider->align(FL_ALIGN_RIGHT);
+		m_cutoffSlider->callback(cb_cutoffSlides);
+
+		// install exposure slider
+		m_exposureSlider = new Fl_Value_Slider(10, 335, 180, 20, "Exposure");
+		m_exposureSlider->user_data((void*)(this));
+		m_exposureSlider->type(FL_HOR_NICE_SLIDER);
+		m_exposureSlider->labelfont(FL_COURIER);
+		m_exposureSlider->labelsize(12);
+		m_exposureSlider->minimum(0.1);
+		m_exposureSlider->maximum(4);
+		m_exposureSlider->step(0.1);
+		m_exposureSlider->value(m_dExposure);
+		m_exposureSlider->align(FL_ALIGN_RIGHT);
+		m_exposureSlider->callback(cb_exposureSlides);
+
 		
 
 
@@ -458,45 +599,10 @@ void GraphicalUI::updateRender() {
 }
 
 #ifdef MULTITHREADED
-void GraphicalUI::threadStart(ThreadPool* tp, void* arg) {
-	GraphicalUI* pUI = (GraphicalUI*)arg;
-	tp->holdMutex();
-	int x = pUI->nextX;
-	int y = pUI->nextY;
-	while (!stopTrace && y < pUI->height) 
-	{
-		int maxX = x + THREAD_CHUNKSIZE;
-		int maxY = min(y + THREAD_CHUNKSIZE,pUI->height);
-		if ( maxX >= pUI->width )
-		{
-			maxX = pUI->width;
-			pUI->nextX = 0;
-			pUI->nextY = min(maxY,pUI->height);
-		}
-		else
-		{
-			pUI->nextX = maxX;
-			pUI->nextY = y;
-		}
-		
-		
-		tp->releaseMutex();
-		for( int yy = y; yy < maxY && !stopTrace ;yy++)
-		{
-			for( int xx = x; xx < maxX && !stopTrace ;xx++)
-			{
-				//pUI->raytracer->tracePixel(xx, yy);
-				//pUI->raytracer->ptrTracePixel(xx, yy);
-				if (!pUI->m_antiAliasInfo) pUI->raytracer->tracePixel(xx,yy);
-				else   pUI->raytracer->tracePixelAntiAlias(xx,yy);
-			}
-		}
-		tp->holdMutex();
-		pUI->m_debuggingWindow->m_debuggingView->setDirty();
-		x = pUI->nextX;
-		y = pUI->nextY;
-	}
-	tp->releaseMutex();
+// Called on a worker thread when a render is over, to get the main
+// thread out of Fl::wait() in stopTracing().
+void GraphicalUI::renderDone(RenderJob* job, void* arg) {
+	Fl::awake();
 }
 #endif
 #endif
@@ -21,10 +21,6 @@
 #include "TraceGLWindow.h"
 #include "debuggingWindow.h"
 
-#ifdef MULTITHREADED
-#include "../threads/ThreadPool.h"
-#endif
-
 class ModelerView;
 
 class GraphicalUI : public TraceUI {
@@ -41,9 +37,16 @@ public:
 
 	Fl_Slider*			m_sizeSlider;
 	Fl_Slider*			m_depthSlider;
+	Fl_Slider*			m_cutoffSlider;
+	Fl_Slider*			m_aaDepthSlider;
+	Fl_Slider*			m_aaContrastSlider;
+	Fl_Slider*			m_exposureSlider;
 
 #ifdef MULTITHREADED
 	Fl_Slider*			m_threadSlider;
+	Fl_Choice*			m_tileOrderChoice;
+	Fl_Check_Button*	m_mortonCheckButton;
+	Fl_Check_Button*	m_progressiveCheckButton;
 #endif
 
 
@@ -61,7 +64,7 @@ public:
 	// member functions
 	void		setRayTracer(RayTracer *tracer);
 
-	static void stopTracing();
+	void stopTracing();
 private:
 	void updateRender();
 
@@ -79,10 +82,17 @@ private:
 
 	static void cb_sizeSlides(Fl_Widget* o, void* v);
 	static void cb_depthSlides(Fl_Widget* o, void* v);
+	static void cb_cutoffSlides(Fl_Widget* o, void* v);
+	static void cb_aaDepthSlides(Fl_Widget* o, void* v);
+	static void cb_aaContrastSlides(Fl_Widget* o, void* v);
+	static void cb_exposureSlides(Fl_Widget* o, void* v);
 
 #ifdef MULTITHREADED
 	static void cb_threadSlides(Fl_Widget* o, void* v);
-	static void threadStart(ThreadPool* tp, void* arg);
+	static void cb_tileOrderChoice(Fl_Widget* o, void* v);
+	static void cb_mortonCheckButton(Fl_Widget* o, void* v);
+	static void cb_progressiveCheckButton(Fl_Widget* o, void* v);
+	static void renderDone(RenderJob* job, void* arg);
 #endif
 
 
@@ -92,8 +102,10 @@ private:
 	static void cb_BSPCheckButton(Fl_Widget* o, void* v);
 	static void cb_antiAliasCheckButton(Fl_Widget* o, void* v);
 
+#ifndef MULTITHREADED
 	static bool doneTrace;		// Flag that gets set when the trace is done
 	static bool stopTrace;		// Flag that gets set when the trace should be stopped
+#endif
 
 	
 	// File dialog stuff
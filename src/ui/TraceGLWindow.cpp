@@ -5,6 +5,7 @@
 
 #include "TraceGLWindow.h"
 #include "../RayTracer.h"
+#include "../scene/raystats.h"
 #include "GraphicalUI.h"
 
 #include "../fileio/imageio.h"
@@ -43,15 +44,16 @@ int TraceGLWindow::handle(int event)
 			std::cout << "Tracing ray at " << x << ", " << y << std::endl;
 			// Have we re-sized since drawing?
 			if(!raytracer->isReady()) 
-				raytracer->traceSetup(m_nWindowWidth, m_nWindowHeight);
+				raytracer->traceSetup(m_nWindowWidth, m_nWindowHeight, traceUI->getRenderSettings());
 
 			debugMode = true;
-			if (!raytracer->Antialias)	raytracer->tracePixel(x, y);
-			else  raytracer->tracePixel(x, y);
+			RayCapture::local().enable();
+			raytracer->tracePixel(x, y);
 
 			//raytracer->ptrTracePixel(x, y);
 			//raytracer->tracePixelAntiAlias(x, y);
 
+			RayCapture::local().disable();
 			((GraphicalUI*) traceUI)->m_debuggingWindow->m_debuggingView->redraw();
 			debugMode = false;
 			refresh();
@@ -13,11 +13,19 @@
 #include <math.h>
 #include "../vecmath/vec.h"
 #include "../vecmath/mat.h"
+#include "../RenderSettings.h"
+#include "../scene/hbv.h"
 
 #include <string>
 
 #define MULTITHREADED
 
+#ifdef MULTITHREADED
+#include "../threads/WorkerPool.h"
+#include "../RenderJob.h"
+#endif
+#include "../threads/CpuInfo.h"
+
 using std::string;
 
 class RayTracer;
@@ -26,9 +34,25 @@ class TraceUI {
 public:
 	TraceUI()
 		: m_nDepth(0), m_nSize(400), 
+		m_dCutoff(0.004),
 		m_displayDebuggingInfo( false ),
 		m_antiAliasInfo(false), 
-		m_BSPInfo(false),
+		m_nAADepth(2),
+		m_dAAContrast(0.05),
+		m_nToneMap(RenderSettings::CLAMP),
+		m_dExposure(1.0),
+		m_BSPInfo(true),
+		m_bSAHBuild(true),
+		m_nSAHBins(16),
+		m_nLeafSize(4),
+		num_threads(0),
+		m_bPinThreads(false),
+		m_nThreadsPerNode(0),
+#ifdef MULTITHREADED
+		m_nTileOrder(TileScheduler::HILBERT),
+		m_bMortonPixels(true),
+		m_bProgressive(false),
+#endif
 		raytracer( 0 )
 	{ }
 
@@ -44,32 +68,92 @@ public:
 	// accessors:
 	int		getSize() const { return m_nSize; }
 	int		getDepth() const { return m_nDepth; }
-
-	void setMultithreading(bool multithread) { this->multithread = multithread; }
-	bool isMultithreading() const { return multithread; }
-
-private:
-	bool multithread;
+	bool	getSAHBuild() const { return m_bSAHBuild; }
+	int		getSAHBins() const { return m_nSAHBins; }
+	int		getLeafSize() const { return m_nLeafSize; }
+	// num_threads, or if that is 0 as many as the process has CPUs for
+	int		getThreads() const 
+		{ return num_threads > 0 ? num_threads : CpuInfo::system().defaultThreads(m_nThreadsPerNode); }
+	bool	getPinThreads() const { return m_bPinThreads; }
+	int		getThreadsPerNode() const { return m_nThreadsPerNode; }
+
+	// How the bvh of the next scene loaded gets built
+	HBVBuildOptions getBuildOptions() const
+	{
+		HBVBuildOptions options;
+		options.method = m_bSAHBuild ? HBVBuildOptions::SAH : HBVBuildOptions::MIDPOINT;
+		options.sahBins = m_nSAHBins;
+		options.maxLeafSize = m_nLeafSize;
+		options.numThreads = getThreads();
+		return options;
+	}
+
+	// The settings the next frame gets rendered with
+	RenderSettings getRenderSettings() const
+	{
+		RenderSettings s;
+		s.depth = m_nDepth;
+		s.cutoff = m_dCutoff;
+		s.antialias = m_antiAliasInfo;
+		s.aaDepth = m_nAADepth;
+		s.aaContrast = m_dAAContrast;
+		s.accelerate = m_BSPInfo;
+		s.toneMap = m_nToneMap;
+		s.exposure = m_dExposure;
+		return s;
+	}
 
 protected:
 	RayTracer*	raytracer;
 
 	int			m_nSize;				// Size of the traced image
 	int			m_nDepth;				// Max depth of recursion
+	double		m_dCutoff;				// weight below which rays aren't followed any further
 
-	int num_threads;
+	int num_threads;			// 0 picks a count from the available CPUs
+	bool m_bPinThreads;			// pin each render thread to one CPU
+	int m_nThreadsPerNode;		// max threads per NUMA node, 0 for no limit
+#ifdef MULTITHREADED
+	TileScheduler::Order m_nTileOrder;	// order tiles are handed out in
+	bool m_bMortonPixels;		// Morton order within tiles, or scanlines
+	bool m_bProgressive;		// coarse to fine passes (see RenderJob::setProgressive)
+#endif
 
 	int width;
 	int height;
-	int nextX;
-	int nextY;
+
+#ifdef MULTITHREADED
+	// Render threads, kept for the life of the UI, and the frame they are
+	// working on.
+	WorkerPool	workers;
+	RenderJob	job;
+
+	// Bring the worker pool and the job in line with the thread settings.
+	void setupWorkers()
+	{
+		int n = getThreads();
+		workers.resize(n, m_bPinThreads ? CpuInfo::system().placement(n, m_nThreadsPerNode) : std::vector<int>());
+		job.setTileOrder(m_nTileOrder);
+		job.setMortonPixels(m_bMortonPixels);
+		job.setProgressive(m_bProgressive);
+	}
+#endif
 
 	// Determines whether or not to show debugging information
 	// for individual rays.  Disabled by default for efficiency
 	// reasons.
 	bool		m_displayDebuggingInfo;
 	bool		m_antiAliasInfo;
-	bool		m_BSPInfo;
+	int			m_nAADepth;				// max splits per pixel, or 0 for a 3x3 grid (see RenderSettings)
+	double		m_dAAContrast;			// colour difference that makes antialiasing split
+	RenderSettings::ToneMap m_nToneMap;	// how colours become 8 bit pixels
+	double		m_dExposure;			// colours are scaled by this before tone mapping
+	bool		m_BSPInfo;				// trace through the bvh (see RenderSettings::accelerate)
+
+	// How the bounding volume hierarchy gets built
+	bool		m_bSAHBuild;			// SAH builder, or midpoint split if false
+	int			m_nSAHBins;				// centroid bins per axis for the SAH builder
+	int			m_nLeafSize;			// max primitives per leaf for the SAH builder
 
 
 
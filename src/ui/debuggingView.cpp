@@ -5,6 +5,7 @@
 #include "../RayTracer.h"
 #include "../scene/scene.h"
 #include "../scene/light.h"
+#include "../scene/raystats.h"
 
 // We include these files from modeler so that we can
 // display the rendered image in OpenGL -- for debugging
@@ -459,12 +460,12 @@ void DebuggingView::drawScene()
 void DebuggingView::drawRays()
 {
 	glDisable( GL_LIGHTING );
-	// Now draw all the rays
-	for( std::vector< std::pair<ray, isect> >::const_iterator rayItr = 
-		raytracer->getScene().intersectCache.begin();
-		rayItr != raytracer->getScene().intersectCache.end();
-		++rayItr )
+	// Now draw all the rays captured by the last single ray trace
+	const RayCapture& capture = RayCapture::local();
+	for( size_t k = 0; k < capture.size(); ++k )
 	{
+		const RayCapture::Entry* rayItr = &capture[k];
+
 		switch( rayItr->first.type() )
 		{
 		case ray::VISIBILITY:
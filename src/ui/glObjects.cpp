@@ -1,5 +1,7 @@
 #pragma warning (disable: 4786)
 
+#ifndef COMMAND_LINE_ONLY
+
 #include <FL/gl.h>
 
 #ifdef __APPLE__
@@ -364,9 +366,9 @@ void Trimesh::glDrawLocal(int quality, bool actualMaterials, bool actualTextures
 		glBegin( GL_TRIANGLES );
 		for( Faces::const_iterator itr = faces.begin(); itr != faces.end(); ++itr )
 		{
-			const int vert1 = (*(*itr))[0];
-			const int vert2 = (*(*itr))[1];
-			const int vert3 = (*(*itr))[2];
+			const int vert1 = (*itr)[0];
+			const int vert2 = (*itr)[1];
+			const int vert3 = (*itr)[2];
 
 			if( normals.empty() )
 			{
@@ -385,19 +387,19 @@ void Trimesh::glDrawLocal(int quality, bool actualMaterials, bool actualTextures
 			if( ! normals.empty() )
 				glNormal3dv( normals[vert1].getPointer() );
 			if( !materials.empty() && actualMaterials )
-				setGLMaterial( *materials[vert1], *itr );
+				setGLMaterial( *materials[vert1], this );
 			glVertex3dv( vertices[vert1].getPointer() );
 
 			if( ! normals.empty() )
 				glNormal3dv( normals[vert2].getPointer() );
 			if( !materials.empty() && actualMaterials )
-				setGLMaterial( *materials[vert2], *itr );
+				setGLMaterial( *materials[vert2], this );
 			glVertex3dv( vertices[vert2].getPointer() );
 
 			if( ! normals.empty() )
 				glNormal3dv( normals[vert3].getPointer() );
 			if( !materials.empty() && actualMaterials )
-				setGLMaterial( *materials[vert3], *itr );
+				setGLMaterial( *materials[vert3], this );
 			glVertex3dv( vertices[vert3].getPointer() );
 		}
 		glEnd();
@@ -650,3 +652,4 @@ void DirectionalLight::glDraw() const
 
 }
 
+#endif
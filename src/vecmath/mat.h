@@ -86,6 +86,8 @@ public:
 
 	Mat3<T> transpose() const { return Mat3<T>(n[0],n[3],n[6],n[1],n[4],n[7],n[2],n[5],n[8]); }
 	double trace() const { return n[0]+n[4]+n[8]; }
+	double determinant() const
+		{ return n[0]*(n[4]*n[8]-n[5]*n[7]) - n[1]*(n[3]*n[8]-n[5]*n[6]) + n[2]*(n[3]*n[7]-n[4]*n[6]); }
 	
 	//---[ GL Matrix ]-------------------------------------
 
@@ -11,8 +11,11 @@ using std::max;
 
 #include <iostream>
 #include <cmath>
+#include <cstring>
 #include <assert.h>
 
+// The command line only build doesn't need (or link) OpenGL
+#ifndef COMMAND_LINE_ONLY
 #ifdef _WIN32
 #include <windows.h>
 #endif
@@ -22,6 +25,7 @@ using std::max;
 #else
 #include <GL/gl.h>
 #endif
+#endif
 
 //==========[ Forward References ]=========================
 
@@ -381,12 +385,14 @@ public:
 	bool iszero() { return ( (n[0]==0 && n[1]==0 && n[2]==0) ? true : false); };
 	void zeroElements() { memset(n,0,sizeof(T)*3); }
 
+#ifndef COMMAND_LINE_ONLY
 	//---[ OpenGL Methods ]----------------------
 
 	void glTranslate() { glTranslated(n[0], n[1], n[2]); }
 	void glColor()  { glColor3d(n[0], n[1], n[2]); }
 	void glVertex()  { glVertex3d(n[0], n[1], n[2]); }
 	void glNormal()  { glNormal3d(n[0], n[1], n[2]); }
+#endif
 
 	//---[ Friend Methods ]----------------------
 
@@ -16,6 +16,7 @@ HEADERS += src/fileio/imageio.h \
     src/parser/Parser.h \
     src/scene/scene.h \
     src/scene/ray.h \
+    src/scene/raystats.h \
     src/scene/material.h \
     src/scene/light.h \
     src/scene/camera.h \
@@ -27,6 +28,9 @@ HEADERS += src/fileio/imageio.h \
     src/SceneObjects/Cone.h \
     src/SceneObjects/Box.h \
     src/threads/ThreadPool.h \
+    src/threads/WorkerPool.h \
+    src/threads/TileScheduler.h \
+    src/threads/CpuInfo.h \
     src/ui/TraceUI.h \
     src/ui/TraceGLWindow.h \
     src/ui/ModelerCamera.h \
@@ -37,7 +41,12 @@ HEADERS += src/fileio/imageio.h \
     src/ui/CommandLineUI.h \
     src/vecmath/vec.h \
     src/vecmath/mat.h \
+    src/BudgetedRender.h \
     src/RayTracer.h \
+    src/RenderFarm.h \
+    src/RenderJob.h \
+    src/RenderServer.h \
+    src/RenderSettings.h \
     src/getopt.h \
     src/general.h
 SOURCES += src/fileio/"file dialog"/Fl_Native_File_Chooser.cxx \
@@ -50,6 +59,7 @@ SOURCES += src/fileio/"file dialog"/Fl_Native_File_Chooser.cxx \
     src/parser/Parser.cpp \
     src/scene/scene.cpp \
     src/scene/ray.cpp \
+    src/scene/raystats.cpp \
     src/scene/material.cpp \
     src/scene/light.cpp \
     src/scene/camera.cpp \
@@ -60,6 +70,9 @@ SOURCES += src/fileio/"file dialog"/Fl_Native_File_Chooser.cxx \
     src/SceneObjects/Cone.cpp \
     src/SceneObjects/Box.cpp \
     src/threads/ThreadPool.cpp \
+    src/threads/WorkerPool.cpp \
+    src/threads/TileScheduler.cpp \
+    src/threads/CpuInfo.cpp \
     src/ui/TraceGLWindow.cpp \
     src/ui/ModelerCamera.cpp \
     src/ui/GraphicalUI.cpp \
@@ -67,7 +80,11 @@ SOURCES += src/fileio/"file dialog"/Fl_Native_File_Chooser.cxx \
     src/ui/debuggingWindow.cxx \
     src/ui/debuggingView.cpp \
     src/ui/CommandLineUI.cpp \
+    src/BudgetedRender.cpp \
     src/RayTracer.cpp \
+    src/RenderFarm.cpp \
+    src/RenderJob.cpp \
+    src/RenderServer.cpp \
     src/main.cpp
 
     